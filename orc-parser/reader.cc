@@ -12,11 +12,23 @@
 
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y)) 
 
+// Stripe and batch boundaries on the timeline written when PIM_TRACE is set
+#if USE_PIM
+#define TRACE_BEGIN(_name, _arg) pim_trace_begin(_name, _arg)
+#define TRACE_END(_name) pim_trace_end(_name)
+#define TRACE_THREAD_NAME(_name, _idx) pim_trace_thread_name(_name, _idx)
+#else
+#define TRACE_BEGIN(_name, _arg)
+#define TRACE_END(_name)
+#define TRACE_THREAD_NAME(_name, _idx)
+#endif
+
 using namespace orc;
 
 struct thread_args {
 	int thread_num;
 	char* filename;
+	uint64_t stripe; // stripe the rows of this thread belong to
 	uint64_t start_row_number;
 	uint64_t num_rows; // number of rows assigned to this thread
 	uint64_t sum;
@@ -29,6 +41,7 @@ struct thread_args {
  */
 void *read_thread(void *arg) {
 	struct thread_args *args = (struct thread_args *)arg;
+	TRACE_THREAD_NAME("reader", args->thread_num);
 
 	// Read in the file as a stream
 	ORC_UNIQUE_PTR<InputStream> inStream = readLocalFile(args->filename);
@@ -44,6 +57,7 @@ void *read_thread(void *arg) {
 	ORC_UNIQUE_PTR<ColumnVectorBatch> batch = rowReader->createRowBatch(batch_size);
 
 	// Seek to this thread's row
+	TRACE_BEGIN("stripe", args->stripe);
 	rowReader->seekToRow(args->start_row_number);
 
 	StructVectorBatch *root = dynamic_cast<StructVectorBatch *>(batch.get());
@@ -54,14 +68,19 @@ void *read_thread(void *arg) {
 	if (args->num_rows % batch_size != 0)
 		row_index_nums ++;	
 	for (uint64_t row_index = 0; row_index < row_index_nums; row_index++) {
-		if (!rowReader->next(*batch))
+		TRACE_BEGIN("batch", row_index);
+		if (!rowReader->next(*batch)) {
+			TRACE_END("batch");
 			break;
+		}
 		
 		for (uint64_t elem = 0; elem < batch->numElements; elem++) {
 			if (first_col->notNull[elem]) {
 				args->sum += first_col->data[elem]; }
 		}
+		TRACE_END("batch");
 	}
+	TRACE_END("stripe");
 
 	return NULL;
 }
@@ -127,6 +146,7 @@ int main(int argc, char *argv[]) {
 			struct thread_args *args = &thread_args[th];
 			args->thread_num = th;
 			args->filename = input_file;
+			args->stripe = i;
 			args->start_row_number = start_row_number;
 			args->sum = 0;
 			if (row_number >= rows_per_thread){
@@ -4,29 +4,26 @@
 #include <stdio.h>
 #include "alloc.h"
 #include "dpu_decompress.h"
+#include "dpu_task.h"
 
 // Comment out to count instructions
 #define COUNT_CYC
 
-#define MAX_INPUT_SIZE (256 * 1024)
-#define MAX_OUTPUT_SIZE (512 * 1024)
-
 // WRAM variables
-__host uint32_t req_idx[NR_TASKLETS];
-__host uint32_t input_length[NR_TASKLETS];
-__host uint32_t output_length[NR_TASKLETS];
-__host uint32_t retval[NR_TASKLETS];
-__host uint32_t perf;
+__host task_descriptor_t descriptors[NR_MRAM_HALVES][NR_TASKLETS][MAX_JOBS_PER_TASKLET];
+__host uint32_t active_half;
 
 // MRAM buffers
-uint8_t __mram_noinit input_buffer[NR_TASKLETS][MAX_INPUT_SIZE];
-uint8_t __mram_noinit output_buffer[NR_TASKLETS][MAX_OUTPUT_SIZE];
+uint8_t __mram_noinit input_buffer[NR_MRAM_HALVES][NR_TASKLETS][MAX_INPUT_SIZE];
+uint8_t __mram_noinit output_buffer[NR_MRAM_HALVES][NR_TASKLETS][MAX_OUTPUT_SIZE];
 
 int main()
 {
 	struct in_buffer_context input;
 	struct out_buffer_context output;
 	uint8_t idx = me();
+	uint32_t half = active_half;
+	task_descriptor_t *desc = descriptors[half][idx];
 	if (idx == 0) {
 		// Clear the heap, needed since we restart the program without
 		// de-allocating and allocating the DPUs
@@ -40,42 +37,55 @@ int main()
 #endif
 
 	printf("DPU starting, tasklet %d\n", idx);
-	
-	// Check that this tasklet has work to run 
-	if (input_length[idx] == 0) {
-		output_length[idx] = 0;
+
+	// Check that this tasklet has work to run
+	if (desc[0].input_length == 0) {
+		desc[0].output_length = 0;
 		printf("Tasklet %d has nothing to run\n", idx);
 		return 0;
 	}
 
-	// Prepare the input and output descriptors
+	// The heap is never freed, so the buffers are allocated once and used
+	// for every block of the tasklet
 	input.cache = seqread_alloc();
-	input.ptr = seqread_init(input.cache, input_buffer[idx], &input.sr);
-	input.curr = 0;
-	input.length = input_length[idx];
-
-	output.buffer = output_buffer[idx];
 	output.append_ptr = (uint8_t*)ALIGN(mem_alloc(OUT_BUFFER_LENGTH), 8);
-	output.append_window = 0;
 	output.read_buf = (uint8_t*)ALIGN(mem_alloc(OUT_BUFFER_LENGTH), 8);
-	output.curr = 0;
-	output.length = output_length[idx];
 
-	// Do the uncompress
-	if (dpu_uncompress(&input, &output))
-	{
-		printf("Tasklet %d: failed in %ld cycles\n", idx, perfcounter_get());
-		retval[idx] = 0;
-		return -1;
-	}
+	int retval = 0;
+	uint32_t input_offset = 0;
+	uint32_t output_offset = 0;
+	for (uint32_t job = 0; job < MAX_JOBS_PER_TASKLET && desc[job].input_length != 0; job++) {
+		// Prepare the input and output descriptors
+		input.ptr = seqread_init(input.cache, &input_buffer[half][idx][input_offset], &input.sr);
+		input.curr = 0;
+		input.length = desc[job].input_length;
+
+		output.buffer = &output_buffer[half][idx][output_offset];
+		output.append_window = 0;
+		output.curr = 0;
+		output.length = desc[job].output_length;
+
+		input_offset += ALIGN(desc[job].input_length, 8);
+		output_offset += ALIGN(desc[job].output_length, 8);
+
+		// Do the uncompress
+		if (dpu_uncompress(&input, &output))
+		{
+			printf("Tasklet %d: block %u failed in %ld cycles\n", idx, job, perfcounter_get());
+			desc[job].perf = perfcounter_get();
+			desc[job].retval = 0;
+			retval = -1;
+			continue;
+		}
 
 #ifdef COUNT_CYC
-	printf("Tasklet %d: %ld cycles, %d bytes\n", idx, perfcounter_get(), output.length);
+		printf("Tasklet %d: %ld cycles, %d bytes\n", idx, perfcounter_get(), output.length);
 #else
-	printf("Tasklet %d: %ld instructions, %d bytes\n", idx, perfcounter_get(), output.length);
-#endif	
-	perf = perfcounter_get();
-	retval[idx] = 1;
-	return 0;
-}
+		printf("Tasklet %d: %ld instructions, %d bytes\n", idx, perfcounter_get(), output.length);
+#endif
+		desc[job].perf = perfcounter_get();
+		desc[job].retval = 1;
+	}
 
+	return retval;
+}
@@ -0,0 +1,33 @@
+#ifndef _DPU_TASK_H_
+#define _DPU_TASK_H_
+
+#include <stdint.h>
+
+// Size of the MRAM input and output buffer of each tasklet
+#define MAX_INPUT_SIZE (256 * 1024)
+#define MAX_OUTPUT_SIZE (512 * 1024)
+
+// Number of batches the MRAM of a DPU holds: the host queues the next batch
+// in one half while the DPU runs the batch in the other
+#define NR_MRAM_HALVES 2
+
+// Most blocks a tasklet decompresses in one launch. A tasklet works through
+// its descriptors in order until it finds one without input, the inputs and
+// outputs of its blocks are packed in its MRAM buffers at 8-byte alignment
+#define MAX_JOBS_PER_TASKLET 8
+
+/**
+ * Work descriptor of one block, shared between the host and the DPU so all
+ * descriptors of a rank move in a single transfer in each direction. The size
+ * must stay a multiple of 8 bytes.
+ */
+typedef struct task_descriptor {
+	uint32_t req_idx;       // Slot of the request on the host
+	uint32_t input_length;  // Length of the compressed input, 0 if the tasklet has no more work
+	uint32_t output_length; // Length of the decompressed output
+	uint32_t retval;        // Set by the DPU, 1 if decompression succeeded, 0 otherwise
+	uint32_t perf;          // Set by the DPU, performance counter when the block was done
+	uint32_t reserved;
+} task_descriptor_t;
+
+#endif	/* _DPU_TASK_H_ */
@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include "pim_snappy.h"
+#include "pim_broker.h"
+
+// Parameters to tune, these are the defaults of the command line options
+#define BROKER_SLOTS 1024   // Blocks clients can have in flight at once
+#define BROKER_WORKERS 4    // Threads submitting blocks to the DPUs
+#define WORKER_SLEEP_MS 100 // Longest time a worker sleeps before checking for shutdown
+#define BROKER_MODE 0600    // Access mode of the segment, only the user running the broker
+
+// Segment of the broker
+//
+// Any client can write to the header of the segment, so the broker only
+// trusts its own copy of the layout, and checks every slot index and length
+// it reads from the segment against it.
+typedef struct broker {
+	pim_broker_shm_t *shm;     // Mapped segment the clients submit to
+	pim_broker_shm_t layout;   // Layout the segment was created with
+} broker_t;
+
+// Argument to a broker worker thread
+typedef struct worker_args {
+	pthread_t thread;        // Handle of the thread
+	const broker_t *broker;  // Segment the clients submit to
+	pim_ctx_t *pim;          // Instance the blocks are decompressed with
+	uint32_t max_claim;      // Most blocks the thread takes at once
+	uint32_t *slots;         // Slots taken, max_claim entries
+	pim_handle_t *handles;   // Request of every slot taken, max_claim entries
+} worker_args_t;
+
+
+/**
+ * Take published blocks off the submission ring. Entries that do not name a
+ * slot of the segment are dropped.
+ *
+ * @param broker: segment of the broker
+ * @param max: most blocks to take
+ * @param slots: filled with the slots of the blocks taken
+ * @return number of blocks taken
+ */
+static uint32_t claim_slots(const broker_t *broker, uint32_t max, uint32_t *slots)
+{
+	pim_broker_shm_t *shm = broker->shm;
+	uint32_t nr_slots = broker->layout.nr_slots;
+	atomic_uint *ring = pim_broker_ring_in(shm, &broker->layout);
+	uint64_t pos = atomic_load(&shm->sub_tail);
+	uint32_t count;
+
+	do {
+		// Only the published prefix can be taken
+		uint64_t head = atomic_load(&shm->sub_head);
+		count = 0;
+		while (count < max && pos + count != head &&
+				atomic_load_explicit(&ring[(pos + count) % nr_slots], memory_order_acquire) != 0)
+			count++;
+		if (count == 0)
+			return 0;
+	} while (!atomic_compare_exchange_weak(&shm->sub_tail, &pos, pos + count));
+
+	uint32_t taken = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t entry = (pos + i) % nr_slots;
+		uint32_t slot = atomic_load_explicit(&ring[entry], memory_order_relaxed) - 1;
+		atomic_store_explicit(&ring[entry], 0, memory_order_relaxed);
+		if (slot >= nr_slots) {
+			fprintf(stderr, "Dropping a block published in invalid slot %u\n", slot);
+			continue;
+		}
+		slots[taken++] = slot;
+	}
+	return taken;
+}
+
+/**
+ * Hand a block back to its client.
+ *
+ * @param broker: segment of the broker
+ * @param slot: slot of the block
+ * @param retval: 1 if decompression succeeded, 0 otherwise
+ */
+static void finish_slot(const broker_t *broker, uint32_t slot, int retval)
+{
+	pim_broker_shm_t *shm = broker->shm;
+	pim_broker_slot_t *entry = pim_broker_slot_in(shm, &broker->layout, slot);
+	entry->retval = retval;
+	atomic_store_explicit(&entry->pending, 0, memory_order_release);
+	pim_broker_futex_wake(&entry->pending, INT_MAX);
+
+	atomic_fetch_add(&shm->completions, 1);
+	if (atomic_load(&shm->completion_waiters))
+		pim_broker_futex_wake(&shm->completions, INT_MAX);
+}
+
+/**
+ * Broker worker thread. Takes the blocks clients publish, submits them to
+ * the decompressor all at once and hands them back as they finish, so the
+ * DPU handler threads see every block that is waiting.
+ *
+ * @param arg: pointer to the worker args
+ */
+static void *broker_worker(void *arg)
+{
+	worker_args_t *worker = (worker_args_t *)arg;
+	const broker_t *broker = worker->broker;
+	pim_broker_shm_t *shm = broker->shm;
+	struct timespec time_to_wait = { .tv_sec = 0, .tv_nsec = WORKER_SLEEP_MS * 1000000L };
+
+	while (atomic_load(&shm->running)) {
+		uint32_t doorbell = atomic_load(&shm->doorbell);
+		uint32_t count = claim_slots(broker, worker->max_claim, worker->slots);
+		if (count == 0) {
+			atomic_fetch_add(&shm->sleeping, 1);
+			if (atomic_load(&shm->sub_tail) == atomic_load(&shm->sub_head))
+				pim_broker_futex_wait(&shm->doorbell, doorbell, &time_to_wait);
+			atomic_fetch_sub(&shm->sleeping, 1);
+			continue;
+		}
+
+		for (uint32_t i = 0; i < count; i++) {
+			// The length is read once, a client changing it afterwards
+			// cannot make the broker read past the input area
+			uint32_t slot = worker->slots[i];
+			uint32_t input_length = pim_broker_slot_in(shm, &broker->layout, slot)->input_length;
+			worker->handles[i] = NULL;
+			if (input_length > broker->layout.input_size ||
+					!pim_decompress_async(worker->pim, pim_broker_input_in(shm, &broker->layout, slot), input_length,
+						pim_broker_output_in(shm, &broker->layout, slot), &worker->handles[i]))
+				finish_slot(broker, slot, 0);
+		}
+
+		for (uint32_t i = 0; i < count; i++) {
+			if (worker->handles[i] != NULL)
+				finish_slot(broker, worker->slots[i], pim_wait(worker->handles[i]));
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Create the shared memory segment of the broker and set up an empty queue.
+ *
+ * @param broker: set to the mapped segment and its layout
+ * @param name: name of the segment
+ * @param mode: access mode of the segment
+ * @param nr_slots: number of slots
+ * @param block_size: largest decompressed block
+ * @return False if the segment could not be created, True otherwise
+ */
+static bool create_segment(broker_t *broker, const char *name, mode_t mode, uint32_t nr_slots, uint32_t block_size)
+{
+	pim_broker_shm_t layout;
+	pim_broker_layout(&layout, nr_slots, block_size);
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, mode);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to create %s: %s\n", name, strerror(errno));
+		return false;
+	}
+	// shm_open applies the umask, the mode asked for is set explicitly
+	if (fchmod(fd, mode) == -1 || ftruncate(fd, layout.size) == -1) {
+		fprintf(stderr, "Failed to set up %s: %s\n", name, strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return false;
+	}
+	void *map = mmap(NULL, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		shm_unlink(name);
+		return false;
+	}
+
+	// The segment is zero-filled, so only the free list needs setting up
+	pim_broker_shm_t *shm = map;
+	*shm = layout;
+	_Atomic uint32_t *free_next = pim_broker_free_next_in(shm, &layout);
+	for (uint32_t i = 0; i < nr_slots; i++)
+		atomic_init(&free_next[i], (i + 1 < nr_slots) ? i + 1 : PIM_BROKER_SLOT_NONE);
+	atomic_init(&shm->free_head, 0);
+	shm->version = PIM_BROKER_VERSION;
+	atomic_thread_fence(memory_order_release);
+	shm->magic = PIM_BROKER_MAGIC;
+
+	broker->shm = shm;
+	broker->layout = layout;
+	return true;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n name] [-m mode] [-s slots] [-w workers]\n", prog);
+	fprintf(stderr, "  -n: shared memory segment clients connect to, default %s\n", PIM_BROKER_DEFAULT_NAME);
+	fprintf(stderr, "  -m: octal access mode of the segment, default %04o\n", BROKER_MODE);
+	fprintf(stderr, "  -s: blocks clients can have in flight at once, default %d\n", BROKER_SLOTS);
+	fprintf(stderr, "  -w: threads submitting blocks to the DPUs, default %d\n", BROKER_WORKERS);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = PIM_BROKER_DEFAULT_NAME;
+	uint32_t nr_slots = BROKER_SLOTS;
+	uint32_t nr_workers = BROKER_WORKERS;
+	mode_t mode = BROKER_MODE;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:m:s:w:")) != -1) {
+		switch (opt) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'm':
+			mode = strtoul(optarg, NULL, 8) & 0666;
+			break;
+		case 's':
+			nr_slots = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			nr_workers = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (nr_slots == 0 || nr_workers == 0 || nr_workers > nr_slots) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Block the shutdown signals before any thread is created, so only
+	// sigwait sees them
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	// The runtime parameters come from the environment like for any other
+	// user of the library. The broker never goes through Snappy itself, so
+	// the CPU decompressor used by the hybrid mode, deadlines and fault
+	// recovery is registered here
+	pim_use_snappy_cpu_decompressor();
+	if (pim_init_ex(NULL) != 0)
+		return 1;
+	pim_ctx_t *pim = pim_get_default();
+
+	broker_t broker;
+	if (!create_segment(&broker, name, mode, nr_slots, pim_get_block_size(pim))) {
+		pim_deinit();
+		return 1;
+	}
+	pim_broker_shm_t *shm = broker.shm;
+
+	atomic_store(&shm->running, 1);
+	worker_args_t *workers = calloc(nr_workers, sizeof(worker_args_t));
+	for (uint32_t i = 0; i < nr_workers; i++) {
+		workers[i].broker = &broker;
+		workers[i].pim = pim;
+		workers[i].max_claim = nr_slots / nr_workers;
+		workers[i].slots = malloc(workers[i].max_claim * sizeof(uint32_t));
+		workers[i].handles = malloc(workers[i].max_claim * sizeof(pim_handle_t));
+		if (pthread_create(&workers[i].thread, NULL, broker_worker, &workers[i]) != 0) {
+			fprintf(stderr, "Failed to create broker worker pthreads\n");
+			return 1;
+		}
+	}
+	printf("Broker serving %s with %u slots of %zu bytes\n", name, nr_slots, pim_get_block_size(pim));
+
+	int sig;
+	sigwait(&signals, &sig);
+
+	// New clients are turned away, and blocks already taken are finished
+	// before the workers exit
+	atomic_store(&shm->running, 0);
+	atomic_fetch_add(&shm->doorbell, 1);
+	pim_broker_futex_wake(&shm->doorbell, INT_MAX);
+	for (uint32_t i = 0; i < nr_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		free(workers[i].slots);
+		free(workers[i].handles);
+	}
+	free(workers);
+
+	// Fail the blocks published after the workers stopped
+	uint32_t slot;
+	while (claim_slots(&broker, 1, &slot) == 1)
+		finish_slot(&broker, slot, 0);
+
+	shm_unlink(name);
+	munmap(shm, broker.layout.size);
+	pim_deinit();
+	return 0;
+}
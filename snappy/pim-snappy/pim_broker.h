@@ -0,0 +1,217 @@
+#ifndef _PIM_BROKER_H_
+#define _PIM_BROKER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Shared memory segment the broker creates when no name is given
+#define PIM_BROKER_DEFAULT_NAME "/pim-snappy"
+
+#define PIM_BROKER_MAGIC 0x424d4950 // "PIMB"
+#define PIM_BROKER_VERSION 1
+
+// Marks the end of the free slot list
+#define PIM_BROKER_SLOT_NONE UINT32_MAX
+
+/**
+ * A block handed to the broker. Clients own a slot from taking it off the
+ * free list until they have copied the output out of it. The slots a client
+ * owns when it dies are never freed, the broker has to be restarted to get
+ * them back.
+ */
+typedef struct pim_broker_slot {
+	atomic_uint pending;    // 1 while the broker handles the block, 0 once done (futex word)
+	uint32_t input_length;  // Length of the compressed block in the input area
+	uint32_t output_length; // Decompressed length of the block, read from its header by the client
+	int32_t retval;         // Set by the broker, 1 if decompression succeeded, 0 otherwise
+} pim_broker_slot_t;
+
+// Header of the shared memory segment of a broker
+//
+// The segment holds, in order, this header, the free slot list (free_next),
+// the submission ring, the slots, then an input and an output area for every
+// slot. Offsets are from the start of the segment.
+//
+// Free slots are kept in a lock-free stack like the request slots of the
+// library. Clients publish a slot by advancing sub_head and storing (slot + 1)
+// into the ring entry of the position they got, 0 meaning claimed but not yet
+// published. Broker workers claim published positions by advancing sub_tail
+// with a CAS. The ring cannot overflow since there are never more blocks than
+// slots.
+typedef struct pim_broker_shm {
+	uint32_t magic;                  // PIM_BROKER_MAGIC once the segment is set up
+	uint32_t version;                // PIM_BROKER_VERSION
+	uint32_t nr_slots;               // Number of slots, and of entries in the ring
+	uint32_t block_size;             // Largest decompressed block
+	uint32_t input_size;             // Size of each input area
+	uint32_t output_size;            // Size of each output area
+	atomic_uint running;             // 1 while the broker serves requests
+	_Atomic uint64_t free_head;      // ABA tag in the upper 32 bits, first free slot in the lower 32 bits
+	_Atomic uint64_t sub_head;       // Next position to be claimed by a client
+	_Atomic uint64_t sub_tail;       // Next position to be taken by a broker worker
+	atomic_uint doorbell;            // Futex word bumped to wake a broker worker
+	atomic_uint sleeping;            // Number of broker workers waiting on doorbell
+	atomic_uint space;               // Futex word bumped every time a slot is freed
+	atomic_uint space_waiters;       // Number of clients waiting for a free slot
+	atomic_uint completions;         // Futex word bumped every time a block is done
+	atomic_uint completion_waiters;  // Number of clients waiting for any block
+	uint64_t free_next_offset;       // Offset of the free slot list
+	uint64_t ring_offset;            // Offset of the submission ring
+	uint64_t slots_offset;           // Offset of the slots
+	uint64_t input_offset;           // Offset of the input areas
+	uint64_t output_offset;          // Offset of the output areas
+	uint64_t size;                   // Size of the whole segment
+} pim_broker_shm_t;
+
+// Connection of a client process to a broker
+typedef struct pim_client pim_client_t;
+
+
+/**
+ * Futex operations on words of the shared segment. These are not private to
+ * the process, so the broker and its clients can wake each other.
+ */
+int pim_broker_futex_wait(atomic_uint *addr, uint32_t val, const struct timespec *timeout);
+void pim_broker_futex_wake(atomic_uint *addr, int count);
+
+/**
+ * Get the layout of a segment for a number of slots and a block size.
+ *
+ * @param shm: header to fill, the offsets and sizes are set
+ * @param nr_slots: number of slots
+ * @param block_size: largest decompressed block
+ */
+void pim_broker_layout(pim_broker_shm_t *shm, uint32_t nr_slots, uint32_t block_size);
+
+// Parts of a segment, at the offsets of a layout. The broker passes its own
+// copy of the layout, since clients can write to the header of the segment
+static inline _Atomic uint32_t *pim_broker_free_next_in(pim_broker_shm_t *shm, const pim_broker_shm_t *layout) {
+	return (_Atomic uint32_t *)((char *)shm + layout->free_next_offset);
+}
+
+static inline atomic_uint *pim_broker_ring_in(pim_broker_shm_t *shm, const pim_broker_shm_t *layout) {
+	return (atomic_uint *)((char *)shm + layout->ring_offset);
+}
+
+static inline pim_broker_slot_t *pim_broker_slot_in(pim_broker_shm_t *shm, const pim_broker_shm_t *layout, uint32_t slot) {
+	return &((pim_broker_slot_t *)((char *)shm + layout->slots_offset))[slot];
+}
+
+static inline char *pim_broker_input_in(pim_broker_shm_t *shm, const pim_broker_shm_t *layout, uint32_t slot) {
+	return (char *)shm + layout->input_offset + (uint64_t)slot * layout->input_size;
+}
+
+static inline char *pim_broker_output_in(pim_broker_shm_t *shm, const pim_broker_shm_t *layout, uint32_t slot) {
+	return (char *)shm + layout->output_offset + (uint64_t)slot * layout->output_size;
+}
+
+// Parts of a segment, at the offsets of its header
+static inline _Atomic uint32_t *pim_broker_free_next(pim_broker_shm_t *shm) {
+	return pim_broker_free_next_in(shm, shm);
+}
+
+static inline atomic_uint *pim_broker_ring(pim_broker_shm_t *shm) {
+	return pim_broker_ring_in(shm, shm);
+}
+
+static inline pim_broker_slot_t *pim_broker_slot(pim_broker_shm_t *shm, uint32_t slot) {
+	return pim_broker_slot_in(shm, shm, slot);
+}
+
+static inline char *pim_broker_input(pim_broker_shm_t *shm, uint32_t slot) {
+	return pim_broker_input_in(shm, shm, slot);
+}
+
+static inline char *pim_broker_output(pim_broker_shm_t *shm, uint32_t slot) {
+	return pim_broker_output_in(shm, shm, slot);
+}
+
+/**
+ * Connect to a running broker.
+ *
+ * @param name: name of the shared memory segment of the broker
+ * @return the connection, NULL if there is no broker with that name
+ */
+pim_client_t *pim_client_connect(const char *name);
+
+/**
+ * Disconnect from a broker. No block may be in flight on the connection.
+ *
+ * @param client: the connection
+ */
+void pim_client_disconnect(pim_client_t *client);
+
+/**
+ * Get the largest decompressed block the broker accepts.
+ *
+ * @param client: the connection
+ * @return the block size in bytes
+ */
+uint32_t pim_client_block_size(const pim_client_t *client);
+
+/**
+ * Get the number of slots of the broker, the most blocks that can be in
+ * flight at once across all of its clients.
+ *
+ * @param client: the connection
+ * @return the number of slots
+ */
+uint32_t pim_client_nr_slots(const pim_client_t *client);
+
+/**
+ * Copy a compressed block to a free slot and hand it to the broker, waiting
+ * for a slot if there is none.
+ *
+ * @param client: the connection
+ * @param compressed: pointer to the compressed data stream
+ * @param compressed_length: length in bytes of the compressed data stream
+ * @param slot: set to the slot the block was submitted in
+ * @return False if the block does not fit in a slot, True otherwise
+ */
+bool pim_client_submit(pim_client_t *client, const char *compressed, size_t compressed_length, uint32_t *slot);
+
+/**
+ * Copy a compressed block to a free slot and hand it to the broker, without
+ * waiting if there is no free slot.
+ *
+ * @param client: the connection
+ * @param compressed: pointer to the compressed data stream
+ * @param compressed_length: length in bytes of the compressed data stream
+ * @param slot: set to the slot the block was submitted in
+ * @return 1 if the block was submitted, 0 if it does not fit in a slot, -EAGAIN if there was no free slot
+ */
+int pim_client_try_submit(pim_client_t *client, const char *compressed, size_t compressed_length, uint32_t *slot);
+
+/**
+ * Check whether the broker is done with a block, without blocking.
+ *
+ * @param client: the connection
+ * @param slot: slot returned by pim_client_submit
+ * @return True if the block is done, False otherwise
+ */
+bool pim_client_poll(pim_client_t *client, uint32_t slot);
+
+/**
+ * Wait for the broker to be done with a block, copy the output out of its
+ * slot and free the slot.
+ *
+ * @param client: the connection
+ * @param slot: slot returned by pim_client_submit, invalid once this returns
+ * @param uncompressed: pointer to where the decompressed data stream should be stored
+ * @return 1 if successful, 0 if there was an error
+ */
+int pim_client_wait(pim_client_t *client, uint32_t slot, char *uncompressed);
+
+/**
+ * Get the futex word bumped every time the broker is done with a block.
+ *
+ * @param client: the connection
+ * @param waiters: set to the number of clients waiting on the word
+ * @return the futex word
+ */
+atomic_uint *pim_client_completions(pim_client_t *client, atomic_uint **waiters);
+
+#endif	/* _PIM_BROKER_H_ */
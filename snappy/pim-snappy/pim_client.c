@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <linux/futex.h>
+
+#include "pim_broker.h"
+#include "dpu_task.h"
+#include "PIM-common/common/include/common.h"
+
+// Connection of a client process to a broker
+struct pim_client {
+	pim_broker_shm_t *shm; // Mapped segment of the broker
+	size_t size;           // Length of the mapping
+};
+
+
+int pim_broker_futex_wait(atomic_uint *addr, uint32_t val, const struct timespec *timeout)
+{
+	if (syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, val, timeout, NULL, 0) == -1)
+		return errno;
+	return 0;
+}
+
+void pim_broker_futex_wake(atomic_uint *addr, int count)
+{
+	syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+void pim_broker_layout(pim_broker_shm_t *shm, uint32_t nr_slots, uint32_t block_size)
+{
+	// Room for the largest compressed form of a block, see
+	// snappy::MaxCompressedLength
+	uint64_t input_size = 32 + (uint64_t)block_size + block_size / 6;
+
+	shm->nr_slots = nr_slots;
+	shm->block_size = block_size;
+	shm->output_size = ALIGN(block_size, 64);
+	shm->input_size = ALIGN(MIN(input_size, MAX_INPUT_SIZE), 64);
+	shm->free_next_offset = ALIGN(sizeof(pim_broker_shm_t), 64);
+	shm->ring_offset = ALIGN(shm->free_next_offset + nr_slots * sizeof(uint32_t), 64);
+	shm->slots_offset = ALIGN(shm->ring_offset + nr_slots * sizeof(uint32_t), 64);
+	shm->input_offset = ALIGN(shm->slots_offset + nr_slots * sizeof(pim_broker_slot_t), 64);
+	shm->output_offset = shm->input_offset + (uint64_t)nr_slots * shm->input_size;
+	shm->size = shm->output_offset + (uint64_t)nr_slots * shm->output_size;
+}
+
+/**
+ * Read the decompressed length from the varint at the start of a block.
+ *
+ * @param compressed: pointer to the compressed data stream
+ * @param compressed_length: length in bytes of the compressed data stream
+ * @param val: set to the decompressed length
+ * @return False if the varint is truncated or longer than 5 bytes, True otherwise
+ */
+static bool read_length(const char *compressed, size_t compressed_length, uint32_t *val)
+{
+	uint32_t result = 0;
+	for (size_t i = 0; i < 5 && i < compressed_length; i++) {
+		uint8_t c = (uint8_t)compressed[i];
+		result |= (uint32_t)(c & 0x7f) << (7 * i);
+		if (!(c & 0x80)) {
+			*val = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Take a slot off the free slot list of a broker.
+ *
+ * @param shm: segment of the broker
+ * @param slot: set to the slot that was taken
+ * @return False if there are no free slots, True otherwise
+ */
+static bool pop_free_slot(pim_broker_shm_t *shm, uint32_t *slot)
+{
+	_Atomic uint32_t *free_next = pim_broker_free_next(shm);
+	uint64_t head = atomic_load(&shm->free_head);
+	uint64_t next;
+
+	do {
+		uint32_t top = (uint32_t)head;
+		if (top == PIM_BROKER_SLOT_NONE)
+			return false;
+		next = (((head >> 32) + 1) << 32) | atomic_load(&free_next[top]);
+	} while (!atomic_compare_exchange_weak(&shm->free_head, &head, next));
+
+	*slot = (uint32_t)head;
+	return true;
+}
+
+/**
+ * Put a slot back on the free slot list of a broker and wake clients waiting
+ * for one.
+ *
+ * @param shm: segment of the broker
+ * @param slot: the slot to free
+ */
+static void push_free_slot(pim_broker_shm_t *shm, uint32_t slot)
+{
+	_Atomic uint32_t *free_next = pim_broker_free_next(shm);
+	uint64_t head = atomic_load(&shm->free_head);
+	uint64_t next;
+
+	do {
+		atomic_store(&free_next[slot], (uint32_t)head);
+		next = (((head >> 32) + 1) << 32) | slot;
+	} while (!atomic_compare_exchange_weak(&shm->free_head, &head, next));
+
+	atomic_fetch_add(&shm->space, 1);
+	if (atomic_load(&shm->space_waiters))
+		pim_broker_futex_wake(&shm->space, INT_MAX);
+}
+
+pim_client_t *pim_client_connect(const char *name)
+{
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd == -1)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(pim_broker_shm_t)) {
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	pim_broker_shm_t *shm = map;
+	if (shm->magic != PIM_BROKER_MAGIC || shm->version != PIM_BROKER_VERSION ||
+			shm->size > (uint64_t)st.st_size || !atomic_load(&shm->running)) {
+		fprintf(stderr, "No broker running on %s\n", name);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	pim_client_t *client = malloc(sizeof(pim_client_t));
+	if (client == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	client->shm = shm;
+	client->size = st.st_size;
+	return client;
+}
+
+void pim_client_disconnect(pim_client_t *client)
+{
+	munmap(client->shm, client->size);
+	free(client);
+}
+
+uint32_t pim_client_block_size(const pim_client_t *client)
+{
+	return client->shm->block_size;
+}
+
+uint32_t pim_client_nr_slots(const pim_client_t *client)
+{
+	return client->shm->nr_slots;
+}
+
+/**
+ * Copy a compressed block to a free slot and hand it to the broker.
+ *
+ * @param client: the connection
+ * @param compressed: pointer to the compressed data stream
+ * @param compressed_length: length in bytes of the compressed data stream
+ * @param slot: set to the slot the block was submitted in
+ * @param block: True to wait for a free slot, False to give up if there is none
+ * @return 1 if the block was submitted, 0 if it does not fit in a slot, -EAGAIN if there was no free slot
+ */
+static int client_submit(pim_client_t *client, const char *compressed, size_t compressed_length, uint32_t *slot, bool block)
+{
+	pim_broker_shm_t *shm = client->shm;
+	uint32_t output_length;
+	if (!atomic_load(&shm->running)) {
+		fprintf(stderr, "Broker is shutting down\n");
+		return false;
+	}
+	if (!read_length(compressed, compressed_length, &output_length)) {
+		fprintf(stderr, "Failed to read decompressed length\n");
+		return false;
+	}
+	if (output_length > shm->block_size || compressed_length > shm->input_size) {
+		fprintf(stderr, "Block too large for the broker\n");
+		return false;
+	}
+
+	// Wait for a slot, reading the counter before retrying so that a slot
+	// freed in between wakes us
+	for (;;) {
+		uint32_t space = atomic_load(&shm->space);
+		if (pop_free_slot(shm, slot))
+			break;
+		if (!block)
+			return -EAGAIN;
+		atomic_fetch_add(&shm->space_waiters, 1);
+		if ((uint32_t)atomic_load(&shm->free_head) == PIM_BROKER_SLOT_NONE)
+			pim_broker_futex_wait(&shm->space, space, NULL);
+		atomic_fetch_sub(&shm->space_waiters, 1);
+	}
+
+	pim_broker_slot_t *entry = pim_broker_slot(shm, *slot);
+	memcpy(pim_broker_input(shm, *slot), compressed, compressed_length);
+	entry->input_length = compressed_length;
+	entry->output_length = output_length;
+	entry->retval = 0;
+	atomic_store_explicit(&entry->pending, 1, memory_order_relaxed);
+
+	// Publish the slot, then wake a broker worker if they are all asleep
+	uint64_t pos = atomic_fetch_add(&shm->sub_head, 1);
+	atomic_store_explicit(&pim_broker_ring(shm)[pos % shm->nr_slots], *slot + 1, memory_order_release);
+	if (atomic_load(&shm->sleeping)) {
+		atomic_fetch_add(&shm->doorbell, 1);
+		pim_broker_futex_wake(&shm->doorbell, 1);
+	}
+
+	return true;
+}
+
+bool pim_client_submit(pim_client_t *client, const char *compressed, size_t compressed_length, uint32_t *slot)
+{
+	return (client_submit(client, compressed, compressed_length, slot, true) == 1);
+}
+
+int pim_client_try_submit(pim_client_t *client, const char *compressed, size_t compressed_length, uint32_t *slot)
+{
+	return client_submit(client, compressed, compressed_length, slot, false);
+}
+
+bool pim_client_poll(pim_client_t *client, uint32_t slot)
+{
+	return atomic_load_explicit(&pim_broker_slot(client->shm, slot)->pending, memory_order_acquire) == 0;
+}
+
+int pim_client_wait(pim_client_t *client, uint32_t slot, char *uncompressed)
+{
+	pim_broker_shm_t *shm = client->shm;
+	pim_broker_slot_t *entry = pim_broker_slot(shm, slot);
+
+	while (atomic_load_explicit(&entry->pending, memory_order_acquire) != 0)
+		pim_broker_futex_wait(&entry->pending, 1, NULL);
+
+	int retval = entry->retval;
+	if (retval == 1)
+		memcpy(uncompressed, pim_broker_output(shm, slot), entry->output_length);
+
+	push_free_slot(shm, slot);
+	return retval;
+}
+
+atomic_uint *pim_client_completions(pim_client_t *client, atomic_uint **waiters)
+{
+	*waiters = &client->shm->completion_waiters;
+	return &client->shm->completions;
+}
@@ -1,13 +1,27 @@
+// For the CPU affinity of the DPU handler threads
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <limits.h>
+#include <math.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
 
 #include <dpu.h>
 #include <dpu_memory.h>
@@ -15,18 +29,33 @@
 #include <dpu_management.h>
 
 #include "pim_snappy.h"
+#include "pim_broker.h"
+#include "pim_trace.h"
+#include "dpu_task.h"
 #include "PIM-common/common/include/common.h"
 
-// Parameters to tune
-#define REQUESTS_TO_WAIT_FOR NR_TASKLETS * 64 // Number of requests to wait for before sending
+// Parameters to tune, these are the defaults of pim_config_t
+#define REQUESTS_PER_TASKLET 64 // Number of requests per tasklet to wait for before sending
 #define MAX_TIME_WAIT_MS 5     // Time in ms to wait before sending current requests
-#define MAX_TIME_WAIT_S (MAX_TIME_WAIT_MS / 1000)
-
-// TODO: consolidate these with what is in dpu_task.c, should be in one place
-#define MAX_INPUT_SIZE (256 * 1024)
-#define MAX_OUTPUT_SIZE (512 * 1024)
-// TODO: Change to BLOCK_SIZE
-#define OUTPUT_SIZE (32 * 1024)
+#define LATENCY_TARGET_US 2000 // Latency to aim for with PIM_BATCH_LATENCY
+#define STAGING_HUGE_PAGES 0   // Set to 1 to back the staging buffers with huge pages
+#ifndef NR_DISPATCHERS
+#define NR_DISPATCHERS 1       // Number of DPU handler threads sharing the ranks, 0 for one per rank
+#endif
+
+#define MAX_NR_TASKLETS 24     // Most tasklets a DPU program can be built with
+#define EWMA_WEIGHT 8          // Weight of the history in the arrival rate and service time averages
+#define RATE_SAMPLE_NS 1000000 // Shortest interval the arrival rate is sampled over
+#define MAX_NUMA_NODES 64      // Nodes beyond this are treated as node 0
+#define FAULT_CHECK_MS 100     // Time a rank with a queued batch can run before it is checked for faults anyway
+#define MAX_CALLER_INSTANCES 8 // Instances a thread has credits counted on, it is not limited on any more
+
+// Longest compressed form of a block, see snappy::MaxCompressedLength
+#define MAX_COMPRESSED_LENGTH(_len) (32 + (_len) + (_len) / 6)
+_Static_assert((BLOCK_SIZE) <= MAX_OUTPUT_SIZE, "BLOCK_SIZE does not fit in the DPU output buffer");
+
+// A transfer from a padded input buffer never reads past the padding
+_Static_assert(PIM_INPUT_PADDING >= MAX_INPUT_SIZE, "PIM_INPUT_PADDING must cover a full transfer");
 
 // to extract components from dpu_id_t
 #define DPU_ID_RANK(_x) ((_x >> 16) & 0xFF)
@@ -35,7 +64,18 @@
 
 #define DPU_CLOCK_CYCLE 266000000// TODO: confirm this
 
-#define NUM_BUFFERS 5
+// Marks the end of the free slot list
+#define FREE_SLOT_NONE UINT32_MAX
+
+// Deadline of a request without one
+#define NO_DEADLINE UINT64_MAX
+
+// Latency histogram updated by the DPU handler threads, see pim_histogram_t
+typedef struct histogram {
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum_ns;
+	_Atomic uint64_t buckets[PIM_HIST_BUCKETS];
+} histogram_t;
 
 // Buffer context struct for input and output buffers on host
 typedef struct host_buffer_context
@@ -43,60 +83,199 @@ typedef struct host_buffer_context
     char *buffer;        // Entire buffer
     char *curr;          // Pointer to current location in buffer
     uint32_t length;     // Length of buffer
+    uint32_t padded_length; // Number of bytes that can safely be read from buffer
 } host_buffer_context_t;
 
 // Arguments passed by a particular thread
 typedef struct caller_args {
-	int data_ready;	               // 1 if request is waiting, 0 once request is handled
+	atomic_uint data_ready;        // 1 if request is waiting, 0 once request is handled (futex word)
 	host_buffer_context_t *input;  // Input buffer
 	host_buffer_context_t *output; // Output buffer
 	int retval;                    // Return error code from processing request
+	atomic_uint *batch_remaining;  // Futex word counting unfinished requests of the batch, NULL if not batched
+	uint32_t slot;                 // Slot of the request in caller_args, sent to the DPU as req_idx
+	uint64_t submit_ns;            // When the request was queued, for the latency statistics
+	atomic_uint *credits;          // Requests in flight of the submitting thread, NULL if not counted
+	uint32_t priority;             // One of pim_priority_t, selects the ring the request is queued on
+	uint64_t deadline_ns;          // When the request should be done by, NO_DEADLINE if it has none
+	uint64_t ring_pos;             // Position the request was published at in its request ring
 } caller_args_t;
 
-// Argument to DPU handler thread
+// Requests of one priority class waiting to be dispatched
+//
+// req_ring is a lock-free multi-producer queue of requests waiting to be
+// dispatched. Positions are 64-bit and only ever increase, the entry of a
+// position is (position % total_request_slots). Callers that hold a slot claim
+// a position by advancing req_head and then publish their request by storing
+// it into the entry. A NULL entry between req_tail_dispatched and req_head is
+// claimed but not yet published. DPU handler threads claim published requests
+// for a launch by advancing req_tail_dispatched with a CAS, then empty their
+// entries. Until they do, an entry still holds a request of the previous lap,
+// so requests carry the position they were published at and an entry only
+// counts as published for that position. The ring cannot overflow since
+// there are never more requests than slots.
+typedef struct request_ring {
+	atomic_uint_fast64_t req_head;         // Next position to be claimed by a caller
+	atomic_uint_fast64_t req_tail_dispatched; // Next position to be loaded to DPU
+	_Atomic(caller_args_t *) *req_ring;    // Requests waiting to be dispatched
+} request_ring_t;
+
+// Requests waiting to be dispatched to the ranks of one NUMA node, with a
+// ring for each priority class
+typedef struct request_queue {
+	request_ring_t rings[PIM_NR_PRIORITIES]; // Ring of each pim_priority_t
+	int node;                              // NUMA node of the ranks the queue feeds
+} request_queue_t;
+
+// Shared state of the DPU handler threads
+//
+// Every request owns a slot in caller_args from submission until completion.
+// Free slots are kept in a lock-free stack (free_head/free_next), so a slot is
+// reusable as soon as its own request completes, in whatever order the ranks
+// finish.
+//
+// Callers queue requests on the node they run on, so their buffers are
+// pushed to ranks on the same socket. DPU handler threads serve the queue of
+// their node first and take requests from the other queues when it is empty.
+// Higher priority classes are served first, whatever node they are queued on.
 typedef struct master_args {
-	int stop_thread;                // Set to 1 to end dpu_master_thread
-	uint32_t req_head;              // Next free slot in caller_args
-	uint32_t req_tail;              // Next busy slot in caller_args
-	uint32_t req_tail_dispatched;   // Next slot to be loaded to DPU in caller_args 
-	uint32_t req_count;             // Number of occupied slots in caller_args
-	uint32_t req_waiting;           // Number of requests waiting that haven't been dispatched
-	uint32_t req_total;
-	caller_args_t **caller_args;    // Request buffer
+	atomic_int stop_thread;                // Set to 1 to end the DPU handler threads
+	request_queue_t *queues;               // One queue per NUMA node with ranks
+	uint32_t nr_queues;                    // Number of queues
+	uint32_t queue_of_node[MAX_NUMA_NODES]; // Queue callers on each node submit to
+	atomic_uint doorbell;                  // Futex word bumped to wake a DPU handler thread
+	atomic_uint sleeping;                  // Number of DPU handler threads waiting on doorbell
+	uint32_t launch_threshold;             // Callers ring the doorbell once this many requests are waiting
+	atomic_uint space;                     // Futex word bumped every time a slot is freed
+	atomic_uint space_waiters;             // Number of callers waiting for a free slot
+	atomic_uint completions;               // Futex word bumped every time a rank is unloaded
+	atomic_uint completion_waiters;        // Number of callers in pim_wait_any
+	_Atomic uint64_t service_ns;           // Latest average time from launch to unload of a rank
+	_Atomic uint64_t deadlines_waiting;    // Requests with a deadline that haven't been claimed yet
+	atomic_uint_fast64_t free_head;        // ABA tag in the upper 32 bits, first free slot in the lower 32 bits
+	_Atomic uint32_t *free_next;           // Next free slot after each free slot
+	caller_args_t **caller_args;           // Request buffer, indexed by slot
+	uint32_t total_request_slots;          // Number of slots, and of entries in each req_ring
 } master_args_t;
 
+// Argument to a DPU handler thread
+typedef struct dispatcher_args {
+	uint32_t id;           // Index of the thread
+	uint32_t first_rank;   // First rank of the pool of consecutive ranks the thread owns
+	uint32_t nr_ranks;     // Number of ranks in the pool
+	pthread_t thread;      // Handle of the thread
+	pim_ctx_t *pim;        // Instance the thread belongs to
+	uint32_t queue;        // Queue of the NUMA node of the pool, served first
+	double memcpy_time;    // Time spent copying requests to the staging buffer
+	uint64_t wait_start;   // When requests were first seen waiting since the last launch, 0 if none
+	uint64_t rate_head;    // Requests submitted when the arrival rate was last sampled
+	uint64_t rate_time;    // When the arrival rate was last sampled
+	double arrival_rate;   // Average requests submitted per ns
+} dispatcher_args_t;
+
+// Request behind a pim_handle_t, holds everything a caller of pim_decompress
+// would otherwise keep on its stack
+struct pim_request {
+	pim_ctx_t *pim; // instance the request was submitted to
+	caller_args_t args;
+	host_buffer_context_t input;
+	host_buffer_context_t output;
+};
+
 // Descriptors for DPUs for performance metrics
  typedef struct host_dpu_descriptor {
  	uint32_t perf; // value from the DPU's performance counter
  } host_dpu_descriptor;
 
- // Rank context struct for performance metrics
+ // Rank context struct for performance metrics and host buffers
  typedef struct host_rank_context {
+ 	struct dpu_set_t rank; // handle of the rank
+ 	uint32_t set_idx; // index of the rank in the allocated DPU set, before the ranks are ordered by node
+ 	int node; // NUMA node the rank is attached to
+ 	pim_ctx_t *pim; // instance the rank belongs to
  	uint32_t dpu_count; // how many dpus are filled in the descriptor array
  	host_dpu_descriptor *dpus; // the descriptors for the dpus in this rank
+ 	task_descriptor_t *descriptors; // nr_tasklets descriptors for each dpu in this rank, for each MRAM half
+ 	uint8_t *staging; // buffer the inputs are copied to before they are pushed to the rank, split in MRAM halves
+ 	size_t staging_size; // length of staging in bytes, for each MRAM half
+ 	uint8_t *output_staging; // buffer for outputs shorter than the transfer of their tasklet row
+ 	size_t output_staging_size; // length of output_staging in bytes
+ 	uint32_t first_half; // MRAM half of the oldest batch on the rank
+ 	uint32_t nr_batches; // batches launched or queued on the rank and not unloaded yet
+ 	bool idle; // set by get_free_ranks when all batches of the rank have finished
+ 	atomic_uint batches_done; // batches that finished running, counted by batch_done
+ 	uint64_t launch_time; // when the rank was last launched
+ 	double service_ns; // average time from launch to unload of the rank
+ 	atomic_bool recovering; // set while the rank is out of service after a fault, see recover_rank
+ 	bool recovery_started; // recovery_thread was created and has to be joined
+ 	pthread_t recovery_thread; // thread recovering the rank from its last fault
+ 	_Atomic uint64_t busy_ns; // time the rank had batches running, summed over its launches
+ 	_Atomic uint64_t batches; // batches launched on the rank
+ 	_Atomic uint64_t requests; // requests launched on the rank
+ 	int32_t track; // timeline track of the rank, see pim_trace_track
+ 	_Atomic uint64_t run_start; // when the running batch started, for the trace
  } host_rank_context;
 
-// Stores number of allocated DPUs
-static struct dpu_set_t dpus, dpu_rank;
-static uint32_t num_ranks = 0;
-static uint32_t num_dpus = 0;
-
-// Thread variables
-static pthread_mutex_t mutex[NUM_BUFFERS];
-static pthread_cond_t caller_cond[NUM_BUFFERS];
-static pthread_cond_t dpu_cond[NUM_BUFFERS];
-
-static pthread_t dpu_master_thread;
-static master_args_t args;
-static uint32_t total_request_slots = 0;
-
-// Performance metrics
-static struct host_rank_context *ctx;
-static uint32_t dpus_per_rank;
+// Value of the DPU's active_half variable for each MRAM half, the source of
+// an asynchronous transfer has to outlive the call
+static const uint32_t mram_half[NR_MRAM_HALVES] = { 0, 1 };
+
+// State of one instance of the decompressor, behind a pim_ctx_t. Each
+// instance has its own ranks, request queue, DPU handler threads and
+// runtime parameters
+struct pim_ctx {
+	pim_config_t config;             // Runtime parameters
+	uint32_t nr_tasklets;            // config.nr_tasklets
+	uint32_t max_block_size;         // config.block_size rounded up to a whole transfer
+	uint32_t jobs_per_tasklet;       // Blocks each tasklet decompresses in one launch
+	uint32_t max_job_input;          // Longest input of a block, so the inputs of a tasklet fit its MRAM buffer
+	struct dpu_set_t dpus;           // Allocated DPUs
+	bool dpus_allocated;             // Whether dpus holds an allocation, to free on errors
+	uint32_t num_ranks;              // Number of allocated ranks
+	uint32_t num_dpus;               // Number of allocated DPUs
+	uint32_t dpus_per_rank;          // Number of DPUs in each rank
+	host_rank_context *ranks;        // Context of every rank
+	dispatcher_args_t *dispatchers;  // DPU handler threads
+	uint32_t nr_dispatchers;         // Number of DPU handler threads
+	master_args_t args;              // Shared state of the DPU handler threads
+	pim_client_t *client;            // Broker the requests are forwarded to, NULL if the instance owns its ranks
+	char program[PATH_MAX];          // DPU program, loaded again on ranks that fault
+	_Atomic uint64_t rank_faults;    // Faults seen on the ranks
+	_Atomic uint64_t requests_recovered; // Requests of faulted ranks decompressed on the CPU instead
+	_Atomic uint64_t rank_reloads;   // Faulted ranks put back in service
+	uint64_t start_time;             // When the instance was created
+	histogram_t latency[PIM_NR_STAGES]; // Latency of each stage of the requests
+	_Atomic uint64_t batches;        // Batches launched
+	_Atomic uint64_t requests;       // Requests launched
+	_Atomic uint64_t batch_capacity; // Blocks the launched batches could hold
+	_Atomic uint64_t input_bytes;    // Compressed bytes sent to the DPUs
+	_Atomic uint64_t output_bytes;   // Decompressed bytes read back from the DPUs
+	_Atomic uint64_t padding_bytes;  // Bytes transferred only to even out the tasklet rows
+};
+
+// Instance used by pim_init, pim_init_ex and pim_deinit
+static pim_ctx_t *default_ctx;
+
+// Requests a thread has in flight on an instance, for config.caller_credits.
+// The counters are never freed, requests submitted by a thread may complete
+// after it exits
+typedef struct caller_credits {
+	const pim_ctx_t *pim;  // Instance the counter is for
+	atomic_uint *in_flight; // Requests in flight, futex word the thread waits on for a credit
+} caller_credits_t;
+static __thread caller_credits_t thread_credits[MAX_CALLER_INSTANCES];
+
+// The CPU decompressor and its cost are shared by every instance, they all
+// run on the same cores
+static uint32_t nr_cpus;
+static _Atomic(pim_cpu_decompress_fn) cpu_decompressor;
+static _Atomic uint64_t cpu_ps_per_byte; // Average CPU time to decompress a byte, 0 until measured
+static atomic_uint cpu_active;          // Number of callers decompressing on the CPU
+
+// NUMA node of every CPU, read by the first pim_create
+static pthread_once_t cpu_nodes_once = PTHREAD_ONCE_INIT;
+static uint8_t node_of_cpu[CPU_SETSIZE];
 
-// Tunning variables
-struct timeval t1, t2;
-double memcpyTime = 0;
 
 /**
  * Attempt to read a varint from the input buffer. The format of a varint
@@ -126,49 +305,443 @@ static inline bool read_varint32(struct host_buffer_context *input, uint32_t *va
 }
 
 /**
- * Get a bitmap of the free ranks currently available.
+ * Get the current time from the monotonic clock.
  *
- * @param free_ranks: each bit is set to 1 if that rank is
- *                    currently available
+ * @return time in ns
  */
-static void get_free_ranks(uint32_t* free_ranks) {
-    struct dpu_set_t dpu_rank, dpu;
-	uint32_t rank_id = 0;
-	
-	DPU_RANK_FOREACH(dpus, dpu_rank) {
+static inline uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Add samples to a latency histogram.
+ *
+ * @param hist: the histogram
+ * @param ns: latency of the samples in ns
+ * @param count: number of samples with that latency
+ */
+static inline void record_latency(histogram_t *hist, uint64_t ns, uint32_t count)
+{
+	uint32_t bucket = (ns != 0) ? 63 - __builtin_clzll(ns) : 0;
+	atomic_fetch_add_explicit(&hist->buckets[MIN(bucket, PIM_HIST_BUCKETS - 1)], count, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->count, count, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->sum_ns, ns * count, memory_order_relaxed);
+}
+
+/**
+ * Sleep until the value of a futex word is no longer val.
+ *
+ * @param addr: futex word to wait on
+ * @param val: value the futex word is expected to hold
+ * @param timeout: relative timeout, NULL to wait forever
+ * @return False if the timeout expired, True otherwise
+ */
+static inline bool futex_wait(atomic_uint *addr, uint32_t val, const struct timespec *timeout)
+{
+	if (syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0) == -1)
+		return (errno != ETIMEDOUT);
+	return true;
+}
+
+/**
+ * Wake threads sleeping on a futex word.
+ *
+ * @param addr: futex word to wake
+ * @param count: maximum number of threads to wake
+ */
+static inline void futex_wake(atomic_uint *addr, int count)
+{
+	syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/**
+ * Get the request published at a position of a request ring.
+ *
+ * @param args: pointer to the DPU handler thread args
+ * @param ring: the ring
+ * @param pos: position in the request ring
+ * @param head: snapshot of req_head, positions past it are not claimed yet
+ * @return the request, or NULL if the position is not published yet
+ */
+static inline caller_args_t *get_request(master_args_t *args, request_ring_t *ring, uint64_t pos, uint64_t head)
+{
+	if (pos == head)
+		return NULL;
+	caller_args_t *req = atomic_load_explicit(&ring->req_ring[pos % args->total_request_slots], memory_order_acquire);
+	if (req == NULL || req->ring_pos != pos)
+		return NULL;
+	return req;
+}
+
+/**
+ * Take a slot off the free slot list.
+ *
+ * @param args: pointer to the DPU handler thread args
+ * @param slot: set to the slot that was taken
+ * @return False if there are no free slots, True otherwise
+ */
+static bool pop_free_slot(master_args_t *args, uint32_t *slot)
+{
+	uint64_t head = atomic_load(&args->free_head);
+	uint64_t next;
+
+	do {
+		uint32_t top = (uint32_t)head;
+		if (top == FREE_SLOT_NONE)
+			return false;
+		next = (((head >> 32) + 1) << 32) | atomic_load(&args->free_next[top]);
+	} while (!atomic_compare_exchange_weak(&args->free_head, &head, next));
+
+	*slot = (uint32_t)head;
+	return true;
+}
+
+/**
+ * Put a slot back on the free slot list and wake a caller waiting for one.
+ *
+ * @param args: pointer to the DPU handler thread args
+ * @param slot: the slot to free
+ */
+static void push_free_slot(master_args_t *args, uint32_t slot)
+{
+	uint64_t head = atomic_load(&args->free_head);
+	uint64_t next;
+
+	do {
+		atomic_store(&args->free_next[slot], (uint32_t)head);
+		next = (((head >> 32) + 1) << 32) | slot;
+	} while (!atomic_compare_exchange_weak(&args->free_head, &head, next));
+
+	// One slot is enough for one waiting caller, a caller that wakes up
+	// and finds the slot taken goes back to sleep
+	atomic_fetch_add(&args->space, 1);
+	if (atomic_load(&args->space_waiters))
+		futex_wake(&args->space, 1);
+}
+
+/**
+ * Hand a finished request back to its caller and release its slot.
+ *
+ * @param pim: instance the request was submitted to
+ * @param slot: slot of the request in caller_args
+ */
+static void complete_request(pim_ctx_t *pim, uint32_t slot)
+{
+	master_args_t *args = &pim->args;
+	caller_args_t *req = args->caller_args[slot];
+	args->caller_args[slot] = NULL;
+	record_latency(&pim->latency[PIM_STAGE_END_TO_END], now_ns() - req->submit_ns, 1);
+
+	// Give the credit back, the submitting thread only waits for one when
+	// it has none left
+	if (req->credits != NULL && atomic_fetch_sub(req->credits, 1) == pim->config.caller_credits)
+		futex_wake(req->credits, 1);
+	push_free_slot(args, slot);
+
+	// The caller may return as soon as it sees this, only the address of
+	// the futex word is used afterwards. Batched callers are only woken once
+	// their last request is done.
+	atomic_uint *batch_remaining = req->batch_remaining;
+	atomic_store_explicit(&req->data_ready, 0, memory_order_release);
+	if (batch_remaining == NULL)
+		futex_wake(&req->data_ready, 1);
+	else if (atomic_fetch_sub(batch_remaining, 1) == 1)
+		futex_wake(batch_remaining, 1);
+}
+
+/**
+ * Decompress a block on the CPU with the registered decompressor, and update
+ * the average CPU time per byte.
+ *
+ * @param input: the compressed block
+ * @param output: where to decompress it
+ * @return 1 if decompression succeeded, 0 otherwise
+ */
+static int run_on_cpu(host_buffer_context_t *input, host_buffer_context_t *output) {
+	struct timespec start, end;
+	pim_cpu_decompress_fn decompress = atomic_load(&cpu_decompressor);
+
+	atomic_fetch_add(&cpu_active, 1);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	int retval = decompress(input->buffer, input->length, output->buffer, output->length) ? 1 : 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	atomic_fetch_sub(&cpu_active, 1);
+
+	// Concurrent updates may get lost, which only slows the average down
+	if (output->length > 0) {
+		int64_t elapsed = (end.tv_sec - start.tv_sec) * 1000000000ll + (end.tv_nsec - start.tv_nsec);
+		int64_t sample = elapsed * 1000 / output->length;
+		int64_t avg = atomic_load(&cpu_ps_per_byte);
+		atomic_store(&cpu_ps_per_byte, avg ? avg + (sample - avg) / EWMA_WEIGHT : sample);
+	}
+	return retval;
+}
+
+/**
+ * Decompress a claimed request on the CPU instead of the DPUs and hand it
+ * back to its caller.
+ *
+ * @param pim: instance the request was submitted to
+ * @param req: the request
+ */
+static void finish_on_cpu(pim_ctx_t *pim, caller_args_t *req) {
+	req->retval = run_on_cpu(req->input, req->output);
+	complete_request(pim, req->slot);
+	atomic_fetch_add(&pim->args.completions, 1);
+	if (atomic_load(&pim->args.completion_waiters))
+		futex_wake(&pim->args.completions, INT_MAX);
+}
+
+/**
+ * Take the requests that would miss their deadline out of a launch, they are
+ * better decompressed on the CPU.
+ *
+ * @param reqs: claimed requests, left with those to launch in the same order
+ * @param count: number of requests in reqs
+ * @param finish_ns: when the launch is expected to be unloaded
+ * @param late: filled with the requests taken out
+ * @return number of requests taken out
+ */
+static uint32_t take_late_requests(caller_args_t **reqs, uint32_t count, uint64_t finish_ns, caller_args_t **late) {
+	if (atomic_load(&cpu_decompressor) == NULL)
+		return 0;
+
+	uint32_t kept = 0, nr_late = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		if (reqs[i]->deadline_ns != NO_DEADLINE && finish_ns > reqs[i]->deadline_ns)
+			late[nr_late++] = reqs[i];
+		else
+			reqs[kept++] = reqs[i];
+	}
+	return nr_late;
+}
+
+/**
+ * Recover a rank from a fault, on a thread of its own so the DPU handler
+ * threads keep serving the other ranks. The requests of every batch on the
+ * rank are decompressed on the CPU instead, then the program is loaded again
+ * and the rank goes back in service. A rank that cannot be loaded again stays
+ * out of service.
+ *
+ * @param arg: context of the rank, with recovering set
+ */
+static void *recover_rank(void *arg) {
+	host_rank_context *rank_ctx = (host_rank_context *)arg;
+	pim_ctx_t *pim = rank_ctx->pim;
+	master_args_t *args = &pim->args;
+	uint32_t cells = pim->dpus_per_rank * pim->nr_tasklets;
+
+	// Let the SDK drop what is still queued on the rank first, the queued
+	// transfers may read straight from the buffers of the callers
+	dpu_sync(rank_ctx->rank);
+
+	// The descriptors of a batch are only overwritten when it is unloaded,
+	// they still list its requests
+	for (uint32_t batch = 0; batch < rank_ctx->nr_batches; batch++) {
+		uint32_t half = (rank_ctx->first_half + batch) % NR_MRAM_HALVES;
+		task_descriptor_t *descriptors = &rank_ctx->descriptors[half * cells * MAX_JOBS_PER_TASKLET];
+		for (uint32_t cell = 0; cell < cells; cell++) {
+			task_descriptor_t *desc = &descriptors[cell * MAX_JOBS_PER_TASKLET];
+			for (uint32_t job = 0; job < pim->jobs_per_tasklet && desc[job].input_length != 0; job++) {
+				caller_args_t *req = args->caller_args[desc[job].req_idx];
+				req->retval = (atomic_load(&cpu_decompressor) != NULL) ? run_on_cpu(req->input, req->output) : 0;
+				complete_request(pim, desc[job].req_idx);
+				atomic_fetch_add(&pim->requests_recovered, 1);
+			}
+		}
+	}
+
+	// Let pim_wait_any callers re-check their handles
+	atomic_fetch_add(&args->completions, 1);
+	if (atomic_load(&args->completion_waiters))
+		futex_wake(&args->completions, INT_MAX);
+
+	// Loading the program again resets the DPUs of the rank
+	rank_ctx->first_half = 0;
+	rank_ctx->nr_batches = 0;
+	atomic_store(&rank_ctx->batches_done, 0);
+	if (dpu_load(rank_ctx->rank, pim->program, NULL) != DPU_OK) {
+		fprintf(stderr, "Failed to reload a faulted DPU rank, leaving it out of service\n");
+		return NULL;
+	}
+	atomic_fetch_add(&pim->rank_reloads, 1);
+	atomic_store(&rank_ctx->recovering, false);
+
+	atomic_fetch_add(&args->doorbell, 1);
+	if (atomic_load(&args->sleeping))
+		futex_wake(&args->doorbell, INT_MAX);
+	return NULL;
+}
+
+/**
+ * Find which of the ranks of a DPU handler thread are free, and start the
+ * recovery of those that faulted.
+ *
+ * @param dispatcher: DPU handler thread, only the ranks in its pool are checked
+ * @param now: current time in ns
+ */
+static void get_free_ranks(dispatcher_args_t *dispatcher, uint64_t now) {
+	pim_ctx_t *pim = dispatcher->pim;
+	struct dpu_set_t dpu;
+
+	for (uint32_t rank_id = dispatcher->first_rank; rank_id < dispatcher->first_rank + dispatcher->nr_ranks; rank_id++) {
+		host_rank_context *rank_ctx = &pim->ranks[rank_id];
 		bool done = 0, fault = 0;
 
-		// Check if any rank is free
-		dpu_status(dpu_rank, &done, &fault);
-		if (fault) {
-			bool dpu_fault = 0;
-			printf("rank %u fault - abort!\n", rank_id);
+		// Ranks being recovered from a fault are out of service
+		if (atomic_load(&rank_ctx->recovering)) {
+			rank_ctx->idle = false;
+			continue;
+		}
 
-			// try to find which DPU caused the fault
-			DPU_FOREACH(dpu_rank, dpu)
+		// Ranks report finished batches through batch_done, so the rank is
+		// free once all of its batches have
+		rank_ctx->idle = (atomic_load(&rank_ctx->batches_done) == rank_ctx->nr_batches);
+		if (rank_ctx->idle)
+			continue;
+
+		// Check a busy rank for faults, unless a queued batch still has
+		// transfers pending on it, which dpu_status would wait for. A batch
+		// that faulted never reports back, so a rank that has been running
+		// for long is checked anyway
+		if (rank_ctx->nr_batches > 1 && now - rank_ctx->launch_time < FAULT_CHECK_MS * 1000000ull)
+			continue;
+		if (dpu_status(rank_ctx->rank, &done, &fault) != DPU_OK)
+			fault = true;
+		if (!fault)
+			continue;
+
+		// try to find which DPU caused the fault
+		DPU_FOREACH(rank_ctx->rank, dpu)
+		{
+			bool dpu_done = 0, dpu_fault = 0;
+			dpu_status(dpu, &dpu_done, &dpu_fault);
+			if (dpu_fault)
 			{
-				if (dpu_fault)
-				{
-					dpu_id_t id = dpu_get_id(dpu.dpu);
-					fprintf(stderr, "[%u:%u:%u] at fault\n", DPU_ID_RANK(id), DPU_ID_SLICE(id), DPU_ID_DPU(id));
+				dpu_id_t id = dpu_get_id(dpu.dpu);
+				fprintf(stderr, "[%u:%u:%u] at fault\n", DPU_ID_RANK(id), DPU_ID_SLICE(id), DPU_ID_DPU(id));
 #ifdef DEBUG_DPU
-					fprintf(stderr, "Halting for debug");
-					while (1)
-						usleep(100000);
+				fprintf(stderr, "Halting for debug");
+				while (1)
+					usleep(100000);
 #endif // DEBUG_DPU
-				}
 			}
-			fprintf(stderr, "Fault on DPU rank %d\n", rank_id);
-			// TODO: error handle
 		}
+		fprintf(stderr, "Fault on DPU rank %d, decompressing its requests on the CPU\n", rank_id);
+		atomic_fetch_add(&pim->rank_faults, 1);
+
+		// Take the rank out of service until it is recovered. The thread of
+		// an earlier recovery is done once the rank is back in service
+		if (rank_ctx->recovery_started)
+			pthread_join(rank_ctx->recovery_thread, NULL);
+		atomic_store(&rank_ctx->recovering, true);
+		rank_ctx->recovery_started = (pthread_create(&rank_ctx->recovery_thread, NULL, recover_rank, rank_ctx) == 0);
+		if (!rank_ctx->recovery_started)
+			recover_rank(rank_ctx);
+	}
+}
+
+/**
+ * Allocate a page-aligned staging buffer on the NUMA node of a rank, faulted
+ * in up front so that launches never take page faults on it.
+ *
+ * @param size: size of the buffer in bytes
+ * @param node: NUMA node to place the buffer on
+ * @return the buffer, or NULL if it could not be allocated
+ */
+static uint8_t *alloc_staging(size_t size, int node) {
+	void *buf = MAP_FAILED;
+#if STAGING_HUGE_PAGES
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (buf == MAP_FAILED)
+		fprintf(stderr, "No huge pages for the staging buffers, using regular pages\n");
+#endif
+	if (buf == MAP_FAILED)
+		buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return NULL;
+
+	// Only a preference, the buffer still gets memory if the node is full
+	unsigned long nodemask = 1ul << node;
+	syscall(SYS_mbind, buf, size, MPOL_PREFERRED, &nodemask, MAX_NUMA_NODES + 1, 0);
+	memset(buf, 0, size);
+	return (uint8_t *)buf;
+}
 
-		if (done) 
-			*free_ranks |= (1 << rank_id);
+/**
+ * Get the NUMA node of a rank.
+ *
+ * @param rank: the rank
+ * @return the node, 0 if it is unknown
+ */
+static int rank_numa_node(struct dpu_set_t rank) {
+	int node = dpu_get_rank_numa_node(dpu_rank_from_set(rank));
+	return (node >= 0 && node < MAX_NUMA_NODES) ? node : 0;
+}
 
-		rank_id++;
+/**
+ * Get the CPUs of a NUMA node.
+ *
+ * @param node: the node
+ * @param cpus: filled with the CPUs of the node
+ * @return False if the CPUs could not be read, True otherwise
+ */
+static bool numa_node_cpus(int node, cpu_set_t *cpus) {
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return false;
+
+	// The list is made of comma-separated CPUs and ranges of CPUs
+	CPU_ZERO(cpus);
+	unsigned first, last;
+	int c = ',';
+	while (c == ',' && fscanf(f, "%u", &first) == 1) {
+		last = first;
+		c = fgetc(f);
+		if (c == '-') {
+			if (fscanf(f, "%u", &last) != 1)
+				break;
+			c = fgetc(f);
+		}
+		for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, cpus);
+	}
+	fclose(f);
+	return CPU_COUNT(cpus) > 0;
+}
+
+/**
+ * Fill node_of_cpu from the CPU lists of the nodes, once per process.
+ */
+static void read_cpu_nodes(void) {
+	cpu_set_t cpus;
+	for (int node = 0; node < MAX_NUMA_NODES; node++) {
+		if (!numa_node_cpus(node, &cpus))
+			continue;
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &cpus))
+				node_of_cpu[cpu] = node;
+		}
 	}
 }
 
+/**
+ * Get the NUMA node the calling thread runs on. sched_getcpu does not enter
+ * the kernel, so this is cheap enough for every submission.
+ *
+ * @return the node, 0 if it is unknown
+ */
+static inline int current_numa_node(void) {
+	int cpu = sched_getcpu();
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return 0;
+	return node_of_cpu[cpu];
+}
+
 /**
  * Calculate the time difference in seconds between start and end.
  *
@@ -183,359 +756,1787 @@ static inline double timediff(struct timeval *start, struct timeval *end) {
 }
 
 /**
- * Load a set of requests to a DPU rank.
+ * Length of the compressed input a request has left to decompress.
+ *
+ * @param req: the request
+ * @return length in bytes
+ */
+static inline uint32_t input_remaining(caller_args_t *req) {
+	return req->input->length - (req->input->curr - req->input->buffer);
+}
+
+/**
+ * Claim published requests of one ring. The request ring is shared by all
+ * DPU handler threads, so the range is claimed with a CAS.
  *
- * @param dpu_rank: pointer to the rank handle to load to
  * @param args: pointer to the DPU handler thread args
+ * @param ring: the ring to claim from
+ * @param max: maximum number of requests to claim
+ * @param max_bytes: maximum total length of the inputs, rounded up to 8 bytes each
+ * @param reqs: filled with the claimed requests, in submission order
+ * @param claimed_bytes: set to the total length of the inputs claimed, rounded up to 8 bytes each
+ * @return number of requests claimed
  */
-static void load_rank(struct dpu_set_t *dpu_rank, master_args_t *args) {
-	uint32_t idx = args->req_tail_dispatched;
-	uint32_t start_idx = args->req_tail_dispatched;
+static uint32_t claim_from_ring(master_args_t *args, request_ring_t *ring, uint32_t max, size_t max_bytes, caller_args_t **reqs, size_t *claimed_bytes) {
+	uint64_t pos = atomic_load(&ring->req_tail_dispatched);
+	uint32_t count;
+	size_t bytes;
+
+	do {
+		// Stop at the first position a caller claimed but hasn't published
+		uint64_t head = atomic_load(&ring->req_head);
+		bytes = 0;
+		// The requests are read while the tail is still at pos, once it
+		// moves the entries can be reused
+		for (count = 0; count < max; count++) {
+			caller_args_t *req = get_request(args, ring, pos + count, head);
+			if (req == NULL || bytes + ALIGN(input_remaining(req), 8) > max_bytes)
+				break;
+			bytes += ALIGN(input_remaining(req), 8);
+			reqs[count] = req;
+		}
+		if (count == 0)
+			return 0;
+	} while (!atomic_compare_exchange_weak(&ring->req_tail_dispatched, &pos, pos + count));
+
+	// The requests are ours now, empty their entries unless a caller of the
+	// next lap already published there
+	for (uint32_t i = 0; i < count; i++) {
+		caller_args_t *expected = reqs[i];
+		atomic_compare_exchange_strong(&ring->req_ring[(pos + i) % args->total_request_slots], &expected, NULL);
+	}
 
-	// Zero out the rank
-	uint32_t zero[NR_TASKLETS];
-	memset(zero, 0, NR_TASKLETS * sizeof(uint32_t));
-	DPU_ASSERT(dpu_copy_to(*dpu_rank, "input_length", 0, zero, NR_TASKLETS * sizeof(uint32_t)));
+	*claimed_bytes = bytes;
+	return count;
+}
 
-	struct dpu_set_t dpu;
-	for (int i = 0; i < NR_TASKLETS; i++) {
-		if (idx == args->req_head)
-			break;
+/**
+ * Claim published requests for a rank launch, highest priority class first.
+ * Within a class the local queue comes first, and the other queues fill what
+ * is left of the launch.
+ *
+ * @param args: pointer to the DPU handler thread args
+ * @param local: index of the queue to claim from first
+ * @param max: maximum number of requests to claim
+ * @param max_bytes: maximum total length of the inputs, rounded up to 8 bytes each
+ * @param reqs: filled with the claimed requests, by priority class then in submission order
+ * @return number of requests claimed
+ */
+static uint32_t claim_requests(master_args_t *args, uint32_t local, uint32_t max, size_t max_bytes, caller_args_t **reqs) {
+	uint32_t count = 0;
+	size_t bytes = 0;
+	for (uint32_t priority = 0; priority < PIM_NR_PRIORITIES && count < max; priority++) {
+		for (uint32_t i = 0; i < args->nr_queues && count < max; i++) {
+			size_t claimed_bytes = 0;
+			request_ring_t *ring = &args->queues[(local + i) % args->nr_queues].rings[priority];
+			count += claim_from_ring(args, ring, max - count, max_bytes - bytes, &reqs[count], &claimed_bytes);
+			bytes += claimed_bytes;
+		}
+	}
 
-		// Copy the index of the request, input and output lengths
-		uint32_t max_input_length = 0;
-		uint32_t total_dpu_count = 0;
-		DPU_FOREACH(*dpu_rank, dpu) {
-			if (idx == args->req_head)
-				break;
+	// Requests with a deadline no longer hold up the launches once claimed
+	uint32_t deadlines = 0;
+	for (uint32_t i = 0; i < count; i++)
+		deadlines += (reqs[i]->deadline_ns != NO_DEADLINE);
+	if (deadlines != 0)
+		atomic_fetch_sub(&args->deadlines_waiting, deadlines);
+	return count;
+}
 
-			DPU_ASSERT(dpu_copy_to(dpu, "req_idx", i * sizeof(uint32_t), &idx, sizeof(uint32_t)));
-			uint32_t input_length = args->caller_args[idx]->input->length - (args->caller_args[idx]->input->curr - args->caller_args[idx]->input->buffer);
-			DPU_ASSERT(dpu_copy_to(dpu, "input_length", i * sizeof(uint32_t), &(input_length), sizeof(uint32_t)));
-			DPU_ASSERT(dpu_copy_to(dpu, "output_length", i * sizeof(uint32_t), &(args->caller_args[idx]->output->length), sizeof(uint32_t))); 
-			// Update max input length
-			max_input_length = MAX(max_input_length, ALIGN(input_length, 8));
+/**
+ * qsort comparator ordering requests by decreasing input length.
+ */
+static int compare_input_length(const void *a, const void *b) {
+	uint32_t len_a = input_remaining(*(caller_args_t * const *)a);
+	uint32_t len_b = input_remaining(*(caller_args_t * const *)b);
+	return (len_a < len_b) - (len_a > len_b);
+}
 
-			idx = (idx + 1) % total_request_slots;
-			total_dpu_count++;
-		}
+/**
+ * qsort comparator ordering ranks by NUMA node.
+ */
+static int compare_rank_node(const void *a, const void *b) {
+	const host_rank_context *rank_a = (const host_rank_context *)a;
+	const host_rank_context *rank_b = (const host_rank_context *)b;
+	if (rank_a->node != rank_b->node)
+		return (rank_a->node > rank_b->node) - (rank_a->node < rank_b->node);
+	return (rank_a->set_idx > rank_b->set_idx) - (rank_a->set_idx < rank_b->set_idx);
+}
 
-		// Copy the input buffer 
-		// TODO: adjust how this is done so we don't have to malloc a massive buffer every time
-		// TODO: Instead of allocating a huge buffer everytime, a buffer size of 
-		// BLOCK_SIZE * NR_TASKLET * total_dpu_count should already be allocated and ready to use.
-		idx = start_idx;
-		uint32_t dpu_count = 0;
-		uint8_t *buf = malloc(max_input_length * total_dpu_count);
-		DPU_FOREACH(*dpu_rank, dpu) {
-			if (idx == args->req_head)
-				break;
+/**
+ * Called by the SDK once a batch launched on a rank has finished running.
+ * Wakes the DPU handler threads so the rank is unloaded right away instead
+ * of at their next timeout.
+ *
+ * @param rank: the rank the batch ran on
+ * @param rank_idx: index of the rank in the set, unused
+ * @param arg: context of the rank
+ */
+static dpu_error_t batch_done(struct dpu_set_t rank, uint32_t rank_idx, void *arg) {
+	(void)rank;
+	(void)rank_idx;
+	host_rank_context *rank_ctx = (host_rank_context *)arg;
+	pim_ctx_t *pim = rank_ctx->pim;
+	atomic_fetch_add(&rank_ctx->batches_done, 1);
+	pim_trace_complete("run", atomic_exchange(&rank_ctx->run_start, pim_trace_now()), 0, rank_ctx->track);
+	pim_trace_mark("rank done", 0, rank_ctx->track);
+
+	atomic_fetch_add(&pim->args.doorbell, 1);
+	if (atomic_load(&pim->args.sleeping))
+		futex_wake(&pim->args.doorbell, INT_MAX);
+	return DPU_OK;
+}
+
+/**
+ * Number of blocks in the descriptors of a tasklet.
+ *
+ * @param pim: instance the tasklet belongs to
+ * @param desc: first descriptor of the tasklet
+ * @return number of blocks, 0 if the tasklet has nothing to run
+ */
+static inline uint32_t count_jobs(pim_ctx_t *pim, task_descriptor_t *desc) {
+	uint32_t job = 0;
+	while (job < pim->jobs_per_tasklet && desc[job].input_length != 0)
+		job++;
+	return job;
+}
+
+/**
+ * Load a set of requests to a DPU rank, in the MRAM half after the one of
+ * the last batch on the rank.
+ *
+ * A queued batch goes to a rank that is still running: its transfers and
+ * launch are queued behind the running batch and start as soon as it
+ * finishes. The staging buffer then has to hold every input of the batch,
+ * which claim_requests is asked to limit.
+ *
+ * @param dpu_rank: pointer to the rank handle to load to
+ * @param reqs: requests to load, claimed with claim_requests
+ * @param count: number of requests to load
+ * @param dispatcher: the DPU handler thread doing the load
+ * @param rank_ctx: context of the rank, holds its staging buffer
+ * @param queued: True to queue the batch behind the running one
+ */
+static void load_rank(struct dpu_set_t *dpu_rank, caller_args_t **reqs, uint32_t count, dispatcher_args_t *dispatcher, struct host_rank_context *rank_ctx, bool queued) {
+	pim_ctx_t *pim = dispatcher->pim;
+	struct timeval t1, t2;
+	uint32_t cells = pim->dpus_per_rank * pim->nr_tasklets;
+	caller_args_t *assigned[cells * pim->jobs_per_tasklet];
+	uint32_t half = (rank_ctx->first_half + rank_ctx->nr_batches) % NR_MRAM_HALVES;
+	task_descriptor_t *descriptors = &rank_ctx->descriptors[half * cells * MAX_JOBS_PER_TASKLET];
+	uint8_t *staging = &rank_ctx->staging[half * rank_ctx->staging_size];
+	size_t staged = 0;
+	dpu_xfer_flags_t flags = queued ? DPU_XFER_ASYNC : DPU_XFER_DEFAULT;
+	uint64_t staging_ns = 0, transfer_ns = 0, input_bytes = 0, output_bytes = 0, padding_bytes = 0;
+
+	uint64_t start = now_ns();
+	for (uint32_t idx = 0; idx < count; idx++)
+		record_latency(&pim->latency[PIM_STAGE_QUEUE_WAIT], start - reqs[idx]->submit_ns, 1);
+
+	// Sorting by length puts requests of similar size in the same tasklet
+	// row, so rows transfer little padding and tasklets finish together.
+	// Rows are filled in alternating directions to spread the long requests
+	// evenly across the DPUs. With more requests than tasklets, every pass
+	// over the tasklets gives each one more block, in the opposite order to
+	// the pass before
+	qsort(reqs, count, sizeof(*reqs), compare_input_length);
+	memset(assigned, 0, sizeof(assigned));
+	for (uint32_t idx = 0; idx < count; idx++) {
+		uint32_t job = idx / cells;
+		uint32_t cell = (job & 1) ? (cells - 1 - idx % cells) : (idx % cells);
+		uint32_t i = cell / pim->dpus_per_rank;
+		uint32_t col = cell % pim->dpus_per_rank;
+		uint32_t dpu_id = (i & 1) ? (pim->dpus_per_rank - 1 - col) : col;
+		assigned[(dpu_id * pim->nr_tasklets + i) * pim->jobs_per_tasklet + job] = reqs[idx];
+	}
 
-			gettimeofday(&t1, NULL);
-			memcpy(&buf[dpu_count * max_input_length], args->caller_args[idx]->input->curr, args->caller_args[idx]->input->length - (args->caller_args[idx]->input->curr - args->caller_args[idx]->input->buffer));
-			gettimeofday(&t2, NULL);
-			memcpyTime += timediff(&t1, &t2);
+	// Tasklets without a descriptor filled in below have nothing to run
+	memset(descriptors, 0, cells * MAX_JOBS_PER_TASKLET * sizeof(task_descriptor_t));
 
-			DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)&buf[dpu_count * max_input_length]));
-			idx = (idx + 1) % total_request_slots;
-			dpu_count++;
-			args->req_waiting--;
+	struct dpu_set_t dpu;
+	uint32_t dpu_id;
+	uint32_t nr_rows = (MIN(count, cells) + pim->dpus_per_rank - 1) / pim->dpus_per_rank;
+	for (uint32_t i = 0; i < nr_rows; i++) {
+		// Fill in the index of the requests, input and output lengths
+		uint32_t max_input_length = 0;
+		uint32_t row_dpus = 0;
+		uint64_t row_bytes = 0;
+		DPU_FOREACH(*dpu_rank, dpu, dpu_id) {
+			caller_args_t **jobs = &assigned[(dpu_id * pim->nr_tasklets + i) * pim->jobs_per_tasklet];
+			task_descriptor_t *desc = &descriptors[(dpu_id * pim->nr_tasklets + i) * MAX_JOBS_PER_TASKLET];
+			uint32_t input_length = 0;
+			for (uint32_t job = 0; job < pim->jobs_per_tasklet && jobs[job] != NULL; job++) {
+				desc[job].req_idx = jobs[job]->slot;
+				desc[job].input_length = input_remaining(jobs[job]);
+				desc[job].output_length = jobs[job]->output->length;
+				input_length += ALIGN(desc[job].input_length, 8);
+				row_bytes += desc[job].input_length;
+				output_bytes += desc[job].output_length;
+			}
+			row_dpus += (jobs[0] != NULL);
+			// Update max input length
+			max_input_length = MAX(max_input_length, input_length);
+		}
+		input_bytes += row_bytes;
+		padding_bytes += (uint64_t)row_dpus * max_input_length - row_bytes;
+
+		// Transfer aligned and padded inputs straight from the caller's buffer,
+		// copy the rest to the staging buffer. Copies are packed, the push
+		// reads past the end of the shorter ones into the next. A synchronous
+		// push is done with the buffer once it returns, so each tasklet row
+		// can reuse it. The blocks of a tasklet with several are always
+		// copied, they have to be back to back
+		if (!queued)
+			staged = 0;
+		DPU_FOREACH(*dpu_rank, dpu, dpu_id) {
+			caller_args_t **jobs = &assigned[(dpu_id * pim->nr_tasklets + i) * pim->jobs_per_tasklet];
+			caller_args_t *req = jobs[0];
+			if (req == NULL)
+				continue;
+
+			uint32_t offset = req->input->curr - req->input->buffer;
+			uint8_t *src = (uint8_t *)req->input->curr;
+			if (((pim->jobs_per_tasklet > 1) && (jobs[1] != NULL)) ||
+					(((uintptr_t)src & 7) != 0) || ((req->input->padded_length - offset) < max_input_length)) {
+				src = &staging[staged];
+				gettimeofday(&t1, NULL);
+				for (uint32_t job = 0; job < pim->jobs_per_tasklet && jobs[job] != NULL; job++) {
+					memcpy(&staging[staged], jobs[job]->input->curr, input_remaining(jobs[job]));
+					staged += ALIGN(input_remaining(jobs[job]), 8);
+				}
+				gettimeofday(&t2, NULL);
+				dispatcher->memcpy_time += timediff(&t1, &t2);
+				staging_ns += (uint64_t)(timediff(&t1, &t2) * 1e9);
+			}
+
+			DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)src));
 		}
 
-		DPU_ASSERT(dpu_push_xfer(*dpu_rank, DPU_XFER_TO_DPU, "input_buffer", i * MAX_INPUT_SIZE, max_input_length, DPU_XFER_DEFAULT));
-		free(buf);
-		start_idx = idx;
+		uint64_t push_start = now_ns();
+		DPU_ASSERT(dpu_push_xfer(*dpu_rank, DPU_XFER_TO_DPU, "input_buffer", (half * pim->nr_tasklets + i) * MAX_INPUT_SIZE, max_input_length, flags));
+		transfer_ns += now_ns() - push_start;
 	}
 
-	args->req_tail_dispatched = idx;
-	
-	// Launch the rank
+	// Send the descriptors of every tasklet in one transfer, and point the
+	// DPUs at this half
+	uint64_t push_start = now_ns();
+	DPU_FOREACH(*dpu_rank, dpu, dpu_id) {
+		DPU_ASSERT(dpu_prepare_xfer(dpu, &descriptors[dpu_id * pim->nr_tasklets * MAX_JOBS_PER_TASKLET]));
+	}
+	DPU_ASSERT(dpu_push_xfer(*dpu_rank, DPU_XFER_TO_DPU, "descriptors", half * pim->nr_tasklets * MAX_JOBS_PER_TASKLET * sizeof(task_descriptor_t), pim->nr_tasklets * MAX_JOBS_PER_TASKLET * sizeof(task_descriptor_t), flags));
+	DPU_ASSERT(dpu_broadcast_to(*dpu_rank, "active_half", 0, &mram_half[half], sizeof(uint32_t), flags));
+	transfer_ns += now_ns() - push_start;
+
+	// Every request of the batch waits for the whole batch to be staged and
+	// pushed before it can run
+	record_latency(&pim->latency[PIM_STAGE_STAGING], staging_ns, count);
+	record_latency(&pim->latency[PIM_STAGE_TRANSFER_IN], transfer_ns, count);
+	atomic_fetch_add(&pim->batches, 1);
+	atomic_fetch_add(&pim->requests, count);
+	atomic_fetch_add(&pim->batch_capacity, (uint64_t)pim->dpus_per_rank * pim->nr_tasklets * pim->jobs_per_tasklet);
+	atomic_fetch_add(&pim->input_bytes, input_bytes);
+	atomic_fetch_add(&pim->output_bytes, output_bytes);
+	atomic_fetch_add(&pim->padding_bytes, padding_bytes);
+	atomic_fetch_add(&rank_ctx->batches, 1);
+	atomic_fetch_add(&rank_ctx->requests, count);
+
+	// Launch the rank. A queued batch starts running once the one before it
+	// is done, see batch_done
+	if (!queued)
+		atomic_store(&rank_ctx->run_start, pim_trace_now());
+	pim_trace_mark("launch", count, rank_ctx->track);
+	rank_ctx->nr_batches++;
 	dpu_launch(*dpu_rank, DPU_ASYNCHRONOUS);
+	DPU_ASSERT(dpu_callback(*dpu_rank, batch_done, rank_ctx, DPU_CALLBACK_ASYNC));
 }
 
 /**
- * Unload the finished requests off of a ran.
+ * Unload the finished requests off of a ran, from the MRAM half of its
+ * oldest batch.
  *
  * @param dpu_rank: pointer to DPU rank handle to unload
- * @param args: pointer to the DPU handler thread args
+ * @param pim: instance the rank belongs to
+ * @param rank_ctx: context of the rank, holds its descriptors
  */
-static void unload_rank(struct dpu_set_t *dpu_rank, master_args_t *args, struct host_rank_context *rank_ctx) {
+static void unload_rank(struct dpu_set_t *dpu_rank, pim_ctx_t *pim, struct host_rank_context *rank_ctx) {
+	master_args_t *args = &pim->args;
 	struct dpu_set_t dpu;
-	uint8_t dpu_id;
+	uint32_t dpu_id;
+	uint32_t half = rank_ctx->first_half;
+	uint32_t tasklet_descriptors = pim->nr_tasklets * MAX_JOBS_PER_TASKLET;
+	task_descriptor_t *descriptors = &rank_ctx->descriptors[half * pim->dpus_per_rank * tasklet_descriptors];
+	uint64_t start = now_ns();
+	uint64_t padding_bytes = 0;
+	uint32_t nr_requests = 0;
+	uint32_t dpu_perf = 0;
+	rank_ctx->first_half = (half + 1) % NR_MRAM_HALVES;
+	rank_ctx->nr_batches--;
+
+	// Get the descriptors of every tasklet in one transfer
+	DPU_FOREACH(*dpu_rank, dpu, dpu_id) {
+		DPU_ASSERT(dpu_prepare_xfer(dpu, &descriptors[dpu_id * tasklet_descriptors]));
+	}
+	DPU_ASSERT(dpu_push_xfer(*dpu_rank, DPU_XFER_FROM_DPU, "descriptors", half * tasklet_descriptors * sizeof(task_descriptor_t), tasklet_descriptors * sizeof(task_descriptor_t), DPU_XFER_DEFAULT));
 
-	uint32_t output_length = 0;
-	for (int i = 0; i < NR_TASKLETS; i++) {
-		// Get the decompressed buffer
-		uint32_t dpu_count = 0;
+	// Get the performance metric, the counter is shared by all tasklets of
+	// a DPU so the DPU ran for as long as its last block
+	for (dpu_id = 0; dpu_id < pim->dpus_per_rank; dpu_id++) {
 		uint32_t perf = 0;
+		for (uint32_t i = 0; i < tasklet_descriptors; i++)
+			perf = MAX(perf, descriptors[dpu_id * tasklet_descriptors + i].perf);
+		rank_ctx->dpus[dpu_id].perf += perf; // cumulative performance
+		dpu_perf = MAX(dpu_perf, perf);
+	}
 
+	task_descriptor_t *row[pim->dpus_per_rank];
+	uint32_t row_jobs[pim->dpus_per_rank];
+	for (uint32_t i = 0; i < pim->nr_tasklets; i++) {
+		// Size the transfer to the longest output of this tasklet row. Rows
+		// are filled in order, so an empty row means the rest are empty too
+		uint32_t max_output_length = 0;
+		uint32_t dpu_count = 0;
+		uint64_t row_bytes = 0;
 		DPU_FOREACH(*dpu_rank, dpu, dpu_id) {
-			output_length = 0;
-			DPU_ASSERT(dpu_copy_from(dpu, "output_length", i * sizeof(uint32_t), &output_length, sizeof(uint32_t)));
-			if (output_length == 0)
-				break;
-			// Get the request index
-			uint32_t req_idx = 0;
-			DPU_ASSERT(dpu_copy_from(dpu, "req_idx", i * sizeof(uint32_t), &req_idx, sizeof(uint32_t)));
-			// TODO fix this in case the ranks complete out of order
-			if (req_idx == args->req_tail) {
-				args->req_count--;
-				args->req_tail = (args->req_tail + 1) % total_request_slots;
+			task_descriptor_t *desc = &descriptors[(dpu_id * pim->nr_tasklets + i) * MAX_JOBS_PER_TASKLET];
+			row_jobs[dpu_id] = count_jobs(pim, desc);
+			row[dpu_id] = (row_jobs[dpu_id] != 0) ? desc : NULL;
+			if (row[dpu_id] == NULL)
+				continue;
+			uint32_t output_length = 0;
+			for (uint32_t job = 0; job < row_jobs[dpu_id]; job++) {
+				output_length += ALIGN(desc[job].output_length, 8);
+				row_bytes += desc[job].output_length;
 			}
-			// Get the return value
-			DPU_ASSERT(dpu_copy_from(dpu, "retval", i * sizeof(uint32_t), &(args->caller_args[req_idx]->retval), sizeof(uint32_t)));
-			args->caller_args[req_idx]->data_ready = 0;
-			// Get the performance metric
-			DPU_ASSERT(dpu_copy_from(dpu, "perf", 0, &perf, sizeof(uint32_t)));
-			rank_ctx->dpus[dpu_id].perf += perf; // cumulative performance
-			// Set up the transfer
-			DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)args->caller_args[req_idx]->output->curr));
+			max_output_length = MAX(max_output_length, output_length);
+			nr_requests += row_jobs[dpu_id];
 			dpu_count++;
 		}
-		DPU_ASSERT(dpu_push_xfer(*dpu_rank, DPU_XFER_FROM_DPU, "output_buffer", i * MAX_OUTPUT_SIZE, OUTPUT_SIZE, DPU_XFER_DEFAULT));
+		if (dpu_count == 0)
+			break;
+		padding_bytes += (uint64_t)dpu_count * max_output_length - row_bytes;
+
+		// Get the decompressed buffer. A single output that is exactly as
+		// long as the transfer goes straight to the caller, shorter ones would
+		// be overrun and the outputs of a tasklet with several blocks are back
+		// to back, so those are retrieved to the staging buffer instead
+		DPU_FOREACH(*dpu_rank, dpu, dpu_id) {
+			task_descriptor_t *desc = row[dpu_id];
+			if (desc == NULL)
+				continue;
+			for (uint32_t job = 0; job < row_jobs[dpu_id]; job++)
+				args->caller_args[desc[job].req_idx]->retval = desc[job].retval;
+			// Set up the transfer
+			uint8_t *dst = (uint8_t *)args->caller_args[desc->req_idx]->output->curr;
+			if (row_jobs[dpu_id] > 1 || desc->output_length != max_output_length)
+				dst = &rank_ctx->output_staging[dpu_id * max_output_length];
+			DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)dst));
+		}
+		if (max_output_length)
+			DPU_ASSERT(dpu_push_xfer(*dpu_rank, DPU_XFER_FROM_DPU, "output_buffer", (half * pim->nr_tasklets + i) * MAX_OUTPUT_SIZE, max_output_length, DPU_XFER_DEFAULT));
+
+		// The output is in place, let the callers go
+		for (dpu_id = 0; dpu_id < pim->dpus_per_rank; dpu_id++) {
+			task_descriptor_t *desc = row[dpu_id];
+			if (desc == NULL)
+				continue;
+			uint8_t *src = &rank_ctx->output_staging[dpu_id * max_output_length];
+			bool staged = row_jobs[dpu_id] > 1 || desc->output_length != max_output_length;
+			for (uint32_t job = 0; job < row_jobs[dpu_id]; job++) {
+				caller_args_t *req = args->caller_args[desc[job].req_idx];
+				if (staged)
+					memcpy(req->output->curr, src, desc[job].output_length);
+				src += ALIGN(desc[job].output_length, 8);
+				complete_request(pim, desc[job].req_idx);
+			}
+		}
 	}
+
+	record_latency(&pim->latency[PIM_STAGE_DPU], (uint64_t)dpu_perf * 1000000000ull / DPU_CLOCK_CYCLE, nr_requests);
+	record_latency(&pim->latency[PIM_STAGE_TRANSFER_OUT], now_ns() - start, nr_requests);
+	atomic_fetch_add(&pim->padding_bytes, padding_bytes);
 }
 
 /**
- * DPU Hander Thread
+ * Number of published or claimed requests of a ring that haven't been
+ * dispatched yet.
  *
- * @param arg: pointer to master_args_t structure
+ * @param ring: the ring
  */
-static void * dpu_uncompress(void *arg) {
-	// Get the thread arguments
-	master_args_t *args = (master_args_t *)arg;
-
-	struct timespec time_to_wait;
-	struct timeval first, second;
-	uint32_t ranks_dispatched = 0;
-
-	// Profiling variables
-	// uint32_t temp=0, reqUnloaded = 0, reqLoaded = 0;
-
-	while (args->stop_thread != 1) { 
-		pthread_mutex_lock(&mutex);
-
-		gettimeofday(&first, NULL);
-		// TODO: Remove; unnecessary
-		gettimeofday(&second, NULL);
-
-		time_to_wait.tv_sec = second.tv_sec;
-		time_to_wait.tv_nsec = (second.tv_usec + MAX_TIME_WAIT_MS * 1000) * 1000; // Wait MAX_TIME_WAIT_MS
-		
-		pthread_cond_timedwait(&dpu_cond, &mutex, &time_to_wait);
-		
-		// Check if our conditions to send the requests are satisfied
-		bool send_req = false;
-		gettimeofday(&second, NULL);
-		if ((args->req_waiting >= REQUESTS_TO_WAIT_FOR) || (timediff(&first, &second) >= MAX_TIME_WAIT_S)) {
-			send_req = true;
-			// profiling logic: print the status every MAX_TIME_WAIT_S
-			// if (timediff(&first, &second) >= MAX_TIME_WAIT_S) {
-			// 	printf("%d\t%d\t%d\n", args->req_waiting, reqUnloaded, reqLoaded);
-			// 	reqUnloaded = 0;
-			// 	reqLoaded = 0;
-			// }
-		}
-		pthread_mutex_unlock(&mutex);
+static inline uint64_t ring_waiting(request_ring_t *ring) {
+	// req_tail_dispatched never passes req_head, so read it first
+	uint64_t dispatched = atomic_load(&ring->req_tail_dispatched);
+	return atomic_load(&ring->req_head) - dispatched;
+}
 
-		// Get the list of ranks currently free
-		uint32_t free_ranks = 0;
-		get_free_ranks(&free_ranks);
+/**
+ * Number of published or claimed requests of a queue that haven't been
+ * dispatched yet.
+ *
+ * @param queue: the queue
+ */
+static inline uint64_t queue_waiting(request_queue_t *queue) {
+	uint64_t waiting = 0;
+	for (uint32_t priority = 0; priority < PIM_NR_PRIORITIES; priority++)
+		waiting += ring_waiting(&queue->rings[priority]);
+	return waiting;
+}
 
-		// If any previously dispatched requests are done, read back the data
-		uint32_t rank_id = 0;
-		struct dpu_set_t dpu_rank;
-		DPU_RANK_FOREACH(dpus, dpu_rank) {
-			if (ranks_dispatched & (1 << rank_id)) {
-				if (free_ranks & (1 << rank_id)) {
-					pthread_mutex_lock(&mutex);
-					// get rank_context
-					host_rank_context* rank_ctx = &ctx[rank_id];
-					// temp = args->req_count;
-					unload_rank(&dpu_rank, args, rank_ctx);
-					// reqUnloaded+= temp - args->req_count;
-					pthread_mutex_unlock(&mutex);
-			
-					ranks_dispatched &= ~(1 << rank_id);
-
-					// Signal that data is ready
-					pthread_cond_broadcast(&caller_cond);
-				}
-			}
-			rank_id++;
-		}
-		// Dispatch all the requests we currently have
-		rank_id = 0;	
-		if (send_req) {
-			DPU_RANK_FOREACH(dpus, dpu_rank) {
-				if ((free_ranks & (1 << rank_id)) && args->req_waiting) {
-					pthread_mutex_lock(&mutex);
-					// temp = args->req_waiting;
-					load_rank(&dpu_rank, args);
-					// reqLoaded += temp - args->req_waiting;
-					pthread_mutex_unlock(&mutex);
-
-					ranks_dispatched |= (1 << rank_id);
-				}
-				rank_id++;
-			}
-		}
-	}	
+/**
+ * Number of requests that are served before a new request of a priority
+ * class, those waiting in its class and in the classes above it.
+ *
+ * @param args: pointer to the DPU handler thread args
+ * @param priority: the priority class
+ */
+static inline uint64_t requests_ahead(master_args_t *args, uint32_t priority) {
+	uint64_t waiting = 0;
+	for (uint32_t i = 0; i < args->nr_queues; i++) {
+		for (uint32_t p = 0; p <= priority; p++)
+			waiting += ring_waiting(&args->queues[i].rings[p]);
+	}
+	return waiting;
+}
 
-	return NULL;
+/**
+ * Number of requests that should be launched without waiting for a fuller
+ * batch: the high priority ones and those with a deadline.
+ *
+ * @param args: pointer to the DPU handler thread args
+ */
+static inline uint64_t requests_urgent(master_args_t *args) {
+	return requests_ahead(args, PIM_PRIORITY_HIGH) + atomic_load(&args->deadlines_waiting);
 }
 
+/**
+ * Number of published or claimed requests that haven't been dispatched yet,
+ * across all queues.
+ *
+ * @param args: pointer to the DPU handler thread args
+ */
+static inline uint64_t requests_waiting(master_args_t *args) {
+	uint64_t waiting = 0;
+	for (uint32_t i = 0; i < args->nr_queues; i++)
+		waiting += queue_waiting(&args->queues[i]);
+	return waiting;
+}
 
-/*************************************************/
-/*                Public Functions               */
-/*************************************************/
+/**
+ * Number of requests ever submitted, across all queues.
+ *
+ * @param args: pointer to the DPU handler thread args
+ */
+static inline uint64_t requests_submitted(master_args_t *args) {
+	uint64_t submitted = 0;
+	for (uint32_t i = 0; i < args->nr_queues; i++) {
+		for (uint32_t priority = 0; priority < PIM_NR_PRIORITIES; priority++)
+			submitted += atomic_load(&args->queues[i].rings[priority].req_head);
+	}
+	return submitted;
+}
 
-int pim_init(void) {
-	// Allocate all DPUs, then check how many were allocated
-	DPU_ASSERT(dpu_alloc(DPU_ALLOCATE_ALL, NULL, &dpus));
-	
-	dpu_get_nr_ranks(dpus, &num_ranks);
-	dpu_get_nr_dpus(dpus, &num_dpus);
-	dpus_per_rank = num_dpus / num_ranks;
-	total_request_slots = num_dpus * NR_TASKLETS;
+/**
+ * Update the average rate at which callers submit requests.
+ *
+ * @param dispatcher: the DPU handler thread keeping the average
+ * @param now: current time in ns
+ */
+static void update_arrival_rate(dispatcher_args_t *dispatcher, uint64_t now) {
+	uint64_t elapsed = now - dispatcher->rate_time;
+	if (elapsed < RATE_SAMPLE_NS)
+		return;
+
+	uint64_t head = requests_submitted(&dispatcher->pim->args);
+	double sample = (double)(head - dispatcher->rate_head) / elapsed;
+	dispatcher->arrival_rate += (sample - dispatcher->arrival_rate) / EWMA_WEIGHT;
+	dispatcher->rate_head = head;
+	dispatcher->rate_time = now;
+}
 
-	// Load the program to all DPUs
-	DPU_ASSERT(dpu_load(dpus, DPU_PROGRAM, NULL));
-
-	// Create the DPU master host thread
-	args.stop_thread = 0;
-	args.req_head = 0;
-	args.req_tail = 0;
-	args.req_count = 0;
-	args.req_waiting = 0;
-	args.req_total = 0;
-	args.caller_args = (caller_args_t **)malloc(sizeof(caller_args_t *) * total_request_slots);
-
-	// allocate space for DPU descriptors for all ranks
-	ctx = calloc(num_ranks, sizeof(host_rank_context));
-	// allocate space for dpu descriptors for all dpus in every rank
-	uint32_t rank_id = 0;
-	DPU_RANK_FOREACH(dpus, dpu_rank) {
-		struct host_dpu_descriptor *rank_input;
-		rank_input = calloc(dpus_per_rank, sizeof(struct host_dpu_descriptor));
-		ctx[rank_id].dpus = rank_input;
-		rank_id++;
-	}
-	
-	if (pthread_create(&dpu_master_thread, NULL, dpu_uncompress, &args) != 0) {
-		fprintf(stderr, "Failed to create dpu_decompress pthreads\n");
-		return -1;
-	}
+/**
+ * Batching policy, decides whether a free rank should be launched with the
+ * requests currently waiting or wait for more.
+ *
+ * @param dispatcher: the DPU handler thread owning the rank
+ * @param rank_ctx: context of the free rank
+ * @param waiting: number of requests waiting
+ * @param now: current time in ns
+ * @param wait_ns: if not launching, set to how long it is worth waiting before asking again
+ * @return True if the rank should be launched now, False otherwise
+ */
+static bool should_launch(dispatcher_args_t *dispatcher, struct host_rank_context *rank_ctx, uint64_t waiting, uint64_t now, uint64_t *wait_ns) {
+	pim_ctx_t *pim = dispatcher->pim;
+	uint64_t capacity = (uint64_t)pim->nr_tasklets * pim->dpus_per_rank * pim->jobs_per_tasklet;
+	uint64_t max_wait_ns = pim->config.max_time_wait_ms * 1000000ull;
 
-	// Create mutex
-	if (pthread_mutex_init(&mutex, NULL) != 0) {
-		fprintf(stderr, "Failed to create mutex\n");
-		return -1;
-	}
+	*wait_ns = max_wait_ns;
+	if (waiting == 0)
+		return false;
 
-	// Create condition variables for both directions
-	if (pthread_cond_init(&caller_cond, NULL) != 0) {
-		fprintf(stderr, "Failed to create calller condition variable\n");
-		return -1;
+	// Every policy launches full ranks right away, and never holds requests
+	// longer than max_time_wait_ms
+	uint64_t waited_ns = now - dispatcher->wait_start;
+	if (waiting >= capacity || waited_ns >= max_wait_ns)
+		return true;
+	*wait_ns = max_wait_ns - waited_ns;
+
+	// Time until enough requests arrive to fill the rank at the current rate
+	double fill_ns = (dispatcher->arrival_rate > 0) ? (capacity - waiting) / dispatcher->arrival_rate : INFINITY;
+
+	switch (pim->config.batch_policy) {
+	case PIM_BATCH_LATENCY:
+		// Only wait for a full rank if the waiting requests still make the target
+		if (waited_ns + fill_ns + rank_ctx->service_ns > pim->config.latency_target_us * 1000.0)
+			return true;
+		break;
+	case PIM_BATCH_THROUGHPUT:
+		// Serving a partial batch beats leaving the rank idle for longer than a launch takes
+		if (fill_ns > rank_ctx->service_ns)
+			return true;
+		break;
+	default:
+		return (waiting >= pim->config.requests_to_wait_for);
 	}
-	if (pthread_cond_init(&dpu_cond, NULL) != 0) {
-		fprintf(stderr, "Failed to create dpu condition variable\n");
-		return -1;
+
+	if (fill_ns < *wait_ns)
+		*wait_ns = (uint64_t)fill_ns;
+	return false;
+}
+
+/**
+ * Check whether a DPU handler thread has nothing to do until callers or its
+ * ranks ring the doorbell: either too few requests are waiting to be worth a
+ * launch, or none of its ranks can take a batch.
+ *
+ * @param dispatcher: the DPU handler thread
+ * @return True if the thread should sleep on the doorbell
+ */
+static bool nothing_to_dispatch(dispatcher_args_t *dispatcher) {
+	pim_ctx_t *pim = dispatcher->pim;
+	master_args_t *args = &pim->args;
+	uint64_t capacity = (uint64_t)pim->nr_tasklets * pim->dpus_per_rank * pim->jobs_per_tasklet;
+	uint64_t waiting = requests_waiting(args);
+	bool urgent = (requests_urgent(args) != 0);
+	if (waiting < args->launch_threshold && !urgent)
+		return true;
+
+	// A rank that finished all of its batches needs unloading, a running
+	// one can only take a queued batch when there is enough to fill it
+	for (uint32_t rank_id = dispatcher->first_rank; rank_id < dispatcher->first_rank + dispatcher->nr_ranks; rank_id++) {
+		host_rank_context *rank_ctx = &pim->ranks[rank_id];
+		if (atomic_load(&rank_ctx->recovering))
+			continue;
+		if (atomic_load(&rank_ctx->batches_done) == rank_ctx->nr_batches)
+			return false;
+		if (rank_ctx->nr_batches < NR_MRAM_HALVES && (waiting >= capacity || urgent))
+			return false;
 	}
+	return true;
+}
+
+/**
+ * DPU Hander Thread
+ *
+ * @param arg: pointer to dispatcher_args_t structure
+ */
+static void * dpu_uncompress(void *arg) {
+	// Get the thread arguments
+	dispatcher_args_t *dispatcher = (dispatcher_args_t *)arg;
+	pim_ctx_t *pim = dispatcher->pim;
+	master_args_t *args = &pim->args;
+
+	uint64_t wait_ns = pim->config.max_time_wait_ms * 1000000ull;
+	caller_args_t *claimed[pim->nr_tasklets * pim->dpus_per_rank * pim->jobs_per_tasklet];
+	caller_args_t *late[pim->nr_tasklets * pim->dpus_per_rank * pim->jobs_per_tasklet];
+
+	pim_trace_thread_name("dispatcher", dispatcher->id);
+	dispatcher->rate_time = now_ns();
+	while (atomic_load(&args->stop_thread) != 1) { 
+		// Sleep until callers ring the doorbell with enough requests to
+		// fill a launch or a rank finishes, or until the batching policy
+		// wants to look again. Busy ranks are still checked for faults every
+		// FAULT_CHECK_MS, since a faulted batch never reports back. The
+		// check is made again once counted as sleeping, so that a doorbell
+		// rung in between is not missed
+		uint32_t doorbell = atomic_load(&args->doorbell);
+		if (nothing_to_dispatch(dispatcher)) {
+			atomic_fetch_add(&args->sleeping, 1);
+			if (nothing_to_dispatch(dispatcher)) {
+				if (requests_waiting(args) >= args->launch_threshold || requests_urgent(args) != 0)
+					wait_ns = FAULT_CHECK_MS * 1000000ull;
+				const struct timespec time_to_wait = {
+					.tv_sec = wait_ns / 1000000000ull,
+					.tv_nsec = wait_ns % 1000000000ull
+				};
+				futex_wait(&args->doorbell, doorbell, &time_to_wait);
+			}
+			atomic_fetch_sub(&args->sleeping, 1);
+		}
+
+		uint64_t now = now_ns();
+		update_arrival_rate(dispatcher, now);
 
-	return 0;
+		// Find the ranks of the pool that are free
+		get_free_ranks(dispatcher, now);
+
+		// If any previously dispatched requests are done, read back the data
+		for (uint32_t rank_id = dispatcher->first_rank; rank_id < dispatcher->first_rank + dispatcher->nr_ranks; rank_id++) {
+			host_rank_context *rank_ctx = &pim->ranks[rank_id];
+			if (rank_ctx->nr_batches == 0 || !rank_ctx->idle)
+				continue;
+
+			double service_ns = (double)(now - rank_ctx->launch_time) / rank_ctx->nr_batches;
+			rank_ctx->service_ns += (service_ns - rank_ctx->service_ns) / EWMA_WEIGHT;
+			atomic_store(&args->service_ns, (uint64_t)rank_ctx->service_ns);
+			atomic_fetch_add(&rank_ctx->busy_ns, now - rank_ctx->launch_time);
+			uint32_t nr_batches = rank_ctx->nr_batches;
+			uint64_t trace_start = pim_trace_now();
+			while (rank_ctx->nr_batches > 0)
+				unload_rank(&rank_ctx->rank, pim, rank_ctx);
+			pim_trace_complete("unload_rank", trace_start, rank_id, 0);
+			atomic_fetch_sub(&rank_ctx->batches_done, nr_batches);
+
+			// Let pim_wait_any callers re-check their handles
+			atomic_fetch_add(&args->completions, 1);
+			if (atomic_load(&args->completion_waiters))
+				futex_wake(&args->completions, INT_MAX);
+		}
+
+		// Dispatch the requests we currently have to the free ranks the
+		// batching policy wants launched. While there are enough requests
+		// to fill a rank, also queue a batch in the idle MRAM half of the
+		// running ranks, so they start on it without waiting to be unloaded
+		// Higher priority classes come first. Within a class requests of the
+		// local queue come first, the ranks only take requests from other
+		// nodes when it is empty
+		uint64_t capacity = (uint64_t)pim->nr_tasklets * pim->dpus_per_rank * pim->jobs_per_tasklet;
+		uint64_t waiting = queue_waiting(&args->queues[dispatcher->queue]);
+		if (waiting == 0)
+			waiting = requests_waiting(args);
+		if (waiting == 0)
+			dispatcher->wait_start = 0;
+		else if (dispatcher->wait_start == 0)
+			dispatcher->wait_start = now;
+
+		// High priority requests and requests with a deadline don't wait for
+		// a fuller batch, and get queued behind a running batch if no rank is
+		// free
+		wait_ns = pim->config.max_time_wait_ms * 1000000ull;
+		bool urgent = (requests_urgent(args) != 0);
+		for (uint32_t rank_id = dispatcher->first_rank; rank_id < dispatcher->first_rank + dispatcher->nr_ranks; rank_id++) {
+			host_rank_context *rank_ctx = &pim->ranks[rank_id];
+			if (atomic_load(&rank_ctx->recovering))
+				continue;
+			bool queue = !rank_ctx->idle && (rank_ctx->nr_batches < NR_MRAM_HALVES) && (waiting >= capacity || urgent);
+			if (!rank_ctx->idle && !queue)
+				continue;
+
+			uint64_t rank_wait_ns;
+			if (rank_ctx->idle && !urgent && !should_launch(dispatcher, rank_ctx, waiting, now, &rank_wait_ns)) {
+				wait_ns = MIN(wait_ns, rank_wait_ns);
+				continue;
+			}
+
+			// A queued batch keeps all of its staged inputs until it runs,
+			// leave room for the push reading past the last one
+			size_t max_bytes = queue ? rank_ctx->staging_size - MAX_INPUT_SIZE : SIZE_MAX;
+			uint32_t count = claim_requests(args, dispatcher->queue, capacity, max_bytes, claimed);
+			if (count == 0)
+				break;
+
+			// Deadlines are checked again now that the launch is known, a
+			// queued batch first waits for the running one. The requests
+			// that would be late are decompressed on the CPU while the rank
+			// runs the others
+			uint64_t finish_ns = now_ns() + (uint64_t)rank_ctx->service_ns * (queue ? 2 : 1);
+			uint32_t nr_late = take_late_requests(claimed, count, finish_ns, late);
+			count -= nr_late;
+			if (count != 0) {
+				uint64_t trace_start = pim_trace_now();
+				load_rank(&rank_ctx->rank, claimed, count, dispatcher, rank_ctx, queue);
+				pim_trace_complete("load_rank", trace_start, rank_id, 0);
+				if (rank_ctx->idle)
+					rank_ctx->launch_time = now_ns();
+				rank_ctx->idle = false;
+			}
+			for (uint32_t i = 0; i < nr_late; i++)
+				finish_on_cpu(pim, late[i]);
+
+			// Whatever is left starts a new wait
+			waiting = queue_waiting(&args->queues[dispatcher->queue]);
+			if (waiting == 0)
+				waiting = requests_waiting(args);
+			urgent = (requests_urgent(args) != 0);
+			dispatcher->wait_start = waiting ? now_ns() : 0;
+		}
+	}	
+
+	return NULL;
 }
 
-void pim_deinit(void) {
+/**
+ * Set up a request for a compressed block.
+ *
+ * @param pim: instance the request is for
+ * @param req: request to set up
+ * @param compressed: pointer to the compressed data stream
+ * @param compressed_length: length in bytes of the compressed data stream
+ * @param padded_length: number of bytes that can be read from compressed, 0 if not padded
+ * @param uncompressed: pointer to where the decompressed data stream should be stored
+ * @return False if the decompressed length could not be read, True otherwise
+ */
+static bool init_request(pim_ctx_t *pim, struct pim_request *req, const char *compressed, size_t compressed_length, size_t padded_length, char *uncompressed) {
+	// Set up in the input and output buffers
+	req->input.buffer = (char *)compressed;
+	req->input.curr = (char *)compressed;
+	req->input.length = compressed_length;
+	req->input.padded_length = MIN(MAX(padded_length, compressed_length), UINT32_MAX);
+
+	req->output.buffer = uncompressed;
+	req->output.curr = uncompressed;
+	req->output.length = 0;
+
+	// Read the decompressed length
+	if (!read_varint32(&req->input, &(req->output.length))) {
+		fprintf(stderr, "Failed to read decompressed length\n");
+		return false;
+	}
+
+	// Check the block fits in the DPU buffers
+	if ((req->output.length > pim->config.block_size) || ((req->input.length - (req->input.curr - req->input.buffer)) > pim->max_job_input)) {
+		fprintf(stderr, "Block too large to decompress on the DPUs\n");
+		return false;
+	}
+
+	// Set up the caller arguments
+	req->pim = pim;
+	req->args.input = &req->input;
+	req->args.output = &req->output;
+	req->args.retval = 0;
+	req->args.batch_remaining = NULL;
+	req->args.priority = PIM_PRIORITY_NORMAL;
+	req->args.deadline_ns = NO_DEADLINE;
+	atomic_init(&req->args.data_ready, 1);
+
+	return true;
+}
+
+/**
+ * Apply the priority class and deadline of a submission to a request.
+ *
+ * @param req: request set up by init_request
+ * @param opts: priority class and deadline, NULL for the defaults
+ * @return False if the priority class is invalid, True otherwise
+ */
+static bool set_request_opts(struct pim_request *req, const pim_request_opts_t *opts) {
+	if (opts == NULL)
+		return true;
+	if (opts->priority >= PIM_NR_PRIORITIES) {
+		fprintf(stderr, "Invalid priority class %u\n", opts->priority);
+		return false;
+	}
+
+	req->args.priority = opts->priority;
+	if (opts->deadline_us != 0)
+		req->args.deadline_ns = now_ns() + opts->deadline_us * 1000ull;
+	return true;
+}
+
+/**
+ * Get the counter of the requests the calling thread has in flight on an
+ * instance.
+ *
+ * @param pim: the instance
+ * @return the counter, NULL if credits are off or the thread uses too many instances
+ */
+static atomic_uint *get_credits(pim_ctx_t *pim) {
+	if (pim->config.caller_credits == 0)
+		return NULL;
+
+	for (uint32_t i = 0; i < MAX_CALLER_INSTANCES; i++) {
+		caller_credits_t *entry = &thread_credits[i];
+		if (entry->pim == pim)
+			return entry->in_flight;
+		if (entry->pim != NULL)
+			continue;
+
+		entry->in_flight = malloc(sizeof(atomic_uint));
+		if (entry->in_flight == NULL)
+			return NULL;
+		atomic_init(entry->in_flight, 0);
+		entry->pim = pim;
+		return entry->in_flight;
+	}
+	return NULL;
+}
+
+/**
+ * Publish a set of requests to the DPU handler thread. Requests get a slot
+ * each, and all the requests that got one are claimed in the request ring
+ * with a single atomic add. A thread also needs one of its credits for each
+ * request, it gets it back when the request completes.
+ *
+ * @param pim: instance to submit to
+ * @param reqs: array of requests of the same priority class and deadline, must stay valid until they are handled
+ * @param count: number of requests in reqs
+ * @param block: True to wait for slots and credits, False to stop at the first request without one
+ * @return number of requests submitted, the first ones of reqs
+ */
+static size_t submit_requests(pim_ctx_t *pim, struct pim_request *reqs, size_t count, bool block) {
+	if (count == 0)
+		return 0;
+
+	master_args_t *args = &pim->args;
+	request_ring_t *ring = &args->queues[args->queue_of_node[current_numa_node()]].rings[reqs[0].args.priority];
+	bool urgent = (reqs[0].args.priority == PIM_PRIORITY_HIGH) || (reqs[0].args.deadline_ns != NO_DEADLINE);
+	atomic_uint *credits = get_credits(pim);
+	size_t submitted = 0;
+	while (submitted < count) {
+		// Take free slots, waiting until there is space to take in more
+		// requests and the thread has credits left. Only this thread takes
+		// its credits, so the count can only go down under it
+		size_t claimed = 0;
+		while (submitted + claimed < count) {
+			caller_args_t *m_args = &reqs[submitted + claimed].args;
+			uint32_t in_flight = (credits != NULL) ? atomic_load(credits) : 0;
+			bool credit = (credits == NULL) || (in_flight < pim->config.caller_credits);
+			if (credit && pop_free_slot(args, &m_args->slot)) {
+				m_args->credits = credits;
+				if (credits != NULL)
+					atomic_fetch_add(credits, 1);
+				args->caller_args[m_args->slot] = m_args;
+				claimed++;
+				continue;
+			}
+			if (claimed || !block)
+				break;
+
+			if (!credit) {
+				futex_wait(credits, in_flight, NULL);
+				continue;
+			}
+
+			uint32_t space = atomic_load(&args->space);
+			atomic_fetch_add(&args->space_waiters, 1);
+			if ((uint32_t)atomic_load(&args->free_head) == FREE_SLOT_NONE)
+				futex_wait(&args->space, space, NULL);
+			atomic_fetch_sub(&args->space_waiters, 1);
+		}
+		if (claimed == 0)
+			break;
+
+		// Count the deadlines before the requests can be claimed
+		if (reqs[0].args.deadline_ns != NO_DEADLINE)
+			atomic_fetch_add(&args->deadlines_waiting, claimed);
+
+		uint64_t pos = atomic_fetch_add(&ring->req_head, claimed);
+		uint64_t now = now_ns();
+		for (size_t i = 0; i < claimed; i++) {
+			reqs[submitted + i].args.submit_ns = now;
+			reqs[submitted + i].args.ring_pos = pos + i;
+			atomic_store_explicit(&ring->req_ring[(pos + i) % args->total_request_slots], &reqs[submitted + i].args, memory_order_release);
+		}
+		submitted += claimed;
+		pim_trace_mark("submit", claimed, 0);
+
+		// Only wake the DPU handler threads once there is enough to fill a
+		// launch or the requests are urgent, otherwise they pick the requests
+		// up when their wait times out. All of them are woken, one without a
+		// free rank would go back to sleep and leave the requests waiting
+		if ((urgent || requests_waiting(args) >= args->launch_threshold) && atomic_load(&args->sleeping)) {
+			atomic_fetch_add(&args->doorbell, 1);
+			futex_wake(&args->doorbell, INT_MAX);
+		}
+	}
+
+	return submitted;
+}
+
+/**
+ * Check whether blocks can be routed to the CPU.
+ *
+ * @param pim: the instance
+ */
+static inline bool hybrid_enabled(pim_ctx_t *pim) {
+	return pim->config.hybrid && (atomic_load(&cpu_decompressor) != NULL);
+}
+
+/**
+ * Estimate how long the DPUs take to return a request, from its position in
+ * the request ring and how long a rank takes to run a batch.
+ *
+ * @param pim: the instance
+ * @param position: number of requests ahead of it
+ * @return time in ns
+ */
+static inline uint64_t dpu_finish_ns(pim_ctx_t *pim, uint64_t position) {
+	uint64_t capacity = (uint64_t)pim->num_ranks * pim->nr_tasklets * pim->dpus_per_rank * pim->jobs_per_tasklet;
+	return (1 + position / capacity) * atomic_load(&pim->args.service_ns);
+}
+
+/**
+ * Estimate how long the CPU takes to decompress a block, sharing the cores
+ * with the callers already decompressing on them.
+ *
+ * @param length: decompressed length of the block
+ * @return time in ns
+ */
+static inline uint64_t cpu_finish_ns(uint32_t length) {
+	uint64_t ns = (uint64_t)length * atomic_load(&cpu_ps_per_byte) / 1000;
+	uint32_t active = atomic_load(&cpu_active) + 1;
+	return (active > nr_cpus) ? ns * active / nr_cpus : ns;
+}
+
+/**
+ * Cost model of the hybrid mode, decides whether a block finishes sooner on
+ * the CPU than behind the requests already waiting for the DPUs.
+ *
+ * @param pim: the instance
+ * @param length: decompressed length of the block
+ * @return True if the block should be decompressed on the CPU
+ */
+static bool prefer_cpu(pim_ctx_t *pim, uint32_t length) {
+	return hybrid_enabled(pim) && (cpu_finish_ns(length) < dpu_finish_ns(pim, requests_waiting(&pim->args)));
+}
+
+/**
+ * Check whether a request would miss its deadline waiting for the DPUs
+ * behind the requests of its priority class and the classes above, so it is
+ * better decompressed on the CPU.
+ *
+ * @param pim: the instance
+ * @param req: the request
+ * @return True if the request should be decompressed on the CPU
+ */
+static bool misses_deadline(pim_ctx_t *pim, caller_args_t *req) {
+	if (req->deadline_ns == NO_DEADLINE || atomic_load(&cpu_decompressor) == NULL)
+		return false;
+	return now_ns() + dpu_finish_ns(pim, requests_ahead(&pim->args, req->priority)) > req->deadline_ns;
+}
+
+/**
+ * Take the oldest request waiting for the DPUs and decompress it on the CPU,
+ * if that beats the DPUs working through everything that is waiting. Lets
+ * callers put their CPU to use while they wait.
+ *
+ * @param pim: instance to take the request from
+ * @return True if a request was decompressed, False otherwise
+ */
+static bool steal_request(pim_ctx_t *pim) {
+	master_args_t *args = &pim->args;
+	if (!hybrid_enabled(pim))
+		return false;
+
+	uint64_t waiting = requests_waiting(args);
+	if (waiting == 0 || cpu_finish_ns(pim->config.block_size) >= dpu_finish_ns(pim, waiting - 1))
+		return false;
+
+	caller_args_t *req;
+	if (claim_requests(args, args->queue_of_node[current_numa_node()], 1, SIZE_MAX, &req) == 0)
+		return false;
+
+	finish_on_cpu(pim, req);
+	return true;
+}
+
+/**
+ * Wait for a submitted request to be handled.
+ *
+ * @param pim: instance the request was submitted to
+ * @param m_args: the request
+ * @return the return value of the request
+ */
+static int wait_request(pim_ctx_t *pim, caller_args_t *m_args) {
+	while (atomic_load_explicit(&m_args->data_ready, memory_order_acquire) != 0) {
+		if (!steal_request(pim))
+			futex_wait(&m_args->data_ready, 1, NULL);
+	}
+
+	pim_trace_mark("wakeup", 1, 0);
+	return m_args->retval;
+}
+
+
+/**
+ * Override a configuration value from an environment variable, if it is set.
+ *
+ * @param name: name of the environment variable
+ * @param val: value to override
+ */
+static void env_override(const char *name, unsigned *val) {
+	const char *env = getenv(name);
+	if (env == NULL || *env == '\0')
+		return;
+
+	char *end;
+	unsigned long parsed = strtoul(env, &end, 0);
+	if (*end != '\0' || parsed > UINT_MAX) {
+		fprintf(stderr, "Ignoring invalid %s=%s\n", name, env);
+		return;
+	}
+	*val = (unsigned)parsed;
+}
+
+/**
+ * Get the path of the DPU program built for the configured number of tasklets.
+ * A "%u" in the configured path is replaced by the number of tasklets. By
+ * default DPU_PROGRAM is used if it was built with that many tasklets, and
+ * the matching decompress-<tasklets>.dpu next to it otherwise.
+ *
+ * @param pim: instance the program is for
+ * @param path: filled with the path of the program
+ * @param len: size of path in bytes
+ * @return False if the path does not fit, True otherwise
+ */
+static bool get_dpu_program(pim_ctx_t *pim, char *path, size_t len) {
+	const char *program = pim->config.dpu_program;
+	int written;
+
+	if (program == NULL && pim->nr_tasklets == NR_TASKLETS)
+		program = DPU_PROGRAM;
+
+	if (program != NULL) {
+		// The path comes from the environment, never use it as a format
+		const char *token = strstr(program, "%u");
+		if (token != NULL)
+			written = snprintf(path, len, "%.*s%u%s", (int)(token - program), program, pim->nr_tasklets, token + 2);
+		else
+			written = snprintf(path, len, "%s", program);
+	}
+	else {
+		// Swap the ".dpu" extension for "-<tasklets>.dpu"
+		size_t base_len = strlen(DPU_PROGRAM);
+		if (base_len >= 4 && strcmp(&DPU_PROGRAM[base_len - 4], ".dpu") == 0)
+			base_len -= 4;
+		written = snprintf(path, len, "%.*s-%u.dpu", (int)base_len, DPU_PROGRAM, pim->nr_tasklets);
+	}
+
+	return (written > 0) && ((size_t)written < len);
+}
+
+
+/**
+ * Decompress a set of blocks through the broker of an instance. At most as
+ * many blocks as the broker has slots are kept in flight, the caller would
+ * otherwise wait for a slot only it can free.
+ *
+ * @param pim: instance connected to a broker
+ * @param blocks: array of blocks to decompress
+ * @param n: number of blocks in the array
+ * @return 1 if every block was successful, 0 if there was an error with any of them
+ */
+static int client_decompress(pim_ctx_t *pim, const pim_block_t *blocks, size_t n) {
+	size_t window = MIN(n, pim_client_nr_slots(pim->client));
+	uint32_t *slots = malloc(window * sizeof(uint32_t));
+	size_t *block_of = malloc(window * sizeof(size_t));
+	if (slots == NULL || block_of == NULL) {
+		free(slots);
+		free(block_of);
+		return false;
+	}
+
+	// slots is used as a ring of the blocks in flight, oldest first
+	int retval = true;
+	size_t oldest = 0, in_flight = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (in_flight == window) {
+			retval &= (pim_client_wait(pim->client, slots[oldest], blocks[block_of[oldest]].uncompressed) == 1);
+			oldest = (oldest + 1) % window;
+			in_flight--;
+		}
+		size_t entry = (oldest + in_flight) % window;
+		if (!pim_client_submit(pim->client, blocks[i].compressed, blocks[i].compressed_length, &slots[entry])) {
+			retval = false;
+			continue;
+		}
+		block_of[entry] = i;
+		in_flight++;
+	}
+	for (; in_flight > 0; in_flight--) {
+		retval &= (pim_client_wait(pim->client, slots[oldest], blocks[block_of[oldest]].uncompressed) == 1);
+		oldest = (oldest + 1) % window;
+	}
+
+	free(slots);
+	free(block_of);
+	return retval;
+}
 
-	// get DPU stats 
+
+/*************************************************/
+/*                Public Functions               */
+/*************************************************/
+
+void pim_config_init(pim_config_t *cfg) {
+	cfg->nr_ranks = 0;
+	cfg->nr_tasklets = NR_TASKLETS;
+	cfg->nr_dispatchers = NR_DISPATCHERS;
+	cfg->requests_to_wait_for = 0;
+	cfg->max_time_wait_ms = MAX_TIME_WAIT_MS;
+	cfg->batch_policy = PIM_BATCH_FIXED;
+	cfg->latency_target_us = LATENCY_TARGET_US;
+	cfg->hybrid = 0;
+	cfg->jobs_per_tasklet = 0;
+	cfg->block_size = (BLOCK_SIZE);
+	cfg->dpu_program = NULL;
+	cfg->dpu_profile = NULL;
+	cfg->caller_credits = 0;
+}
+
+int pim_init(void) {
+	// Share the DPUs of a running broker instead of allocating them
+	const char *broker = getenv("PIM_BROKER");
+	if (broker != NULL && *broker != '\0') {
+		default_ctx = pim_connect(broker);
+		return (default_ctx != NULL) ? 0 : -1;
+	}
+
+	return pim_init_ex(NULL);
+}
+
+int pim_init_ex(const pim_config_t *cfg) {
+	pim_config_t config;
+
+	// Start from the defaults, then apply the environment on top
+	if (cfg != NULL)
+		config = *cfg;
+	else
+		pim_config_init(&config);
+
+	env_override("PIM_NR_RANKS", &config.nr_ranks);
+	env_override("PIM_NR_TASKLETS", &config.nr_tasklets);
+	env_override("PIM_NR_DISPATCHERS", &config.nr_dispatchers);
+	env_override("PIM_REQUESTS_TO_WAIT_FOR", &config.requests_to_wait_for);
+	env_override("PIM_MAX_TIME_WAIT_MS", &config.max_time_wait_ms);
+	env_override("PIM_BATCH_POLICY", &config.batch_policy);
+	env_override("PIM_LATENCY_TARGET_US", &config.latency_target_us);
+	env_override("PIM_HYBRID", &config.hybrid);
+	env_override("PIM_JOBS_PER_TASKLET", &config.jobs_per_tasklet);
+	env_override("PIM_BLOCK_SIZE", &config.block_size);
+	env_override("PIM_CALLER_CREDITS", &config.caller_credits);
+	if (getenv("PIM_DPU_PROGRAM") != NULL && *getenv("PIM_DPU_PROGRAM") != '\0')
+		config.dpu_program = getenv("PIM_DPU_PROGRAM");
+	if (getenv("PIM_DPU_PROFILE") != NULL && *getenv("PIM_DPU_PROFILE") != '\0')
+		config.dpu_profile = getenv("PIM_DPU_PROFILE");
+
+	default_ctx = pim_create(&config);
+	return (default_ctx != NULL) ? 0 : -1;
+}
+
+pim_ctx_t *pim_get_default(void) {
+	return default_ctx;
+}
+
+pim_ctx_t *pim_connect(const char *name) {
+	pim_ctx_t *pim = calloc(1, sizeof(pim_ctx_t));
+	if (pim == NULL)
+		return NULL;
+
+	pim->client = pim_client_connect(name);
+	if (pim->client == NULL) {
+		fprintf(stderr, "Failed to connect to broker %s\n", name);
+		free(pim);
+		return NULL;
+	}
+
+	// Blocks are checked against the block size of the broker, the other
+	// parameters are the broker's own business
+	pim_config_init(&pim->config);
+	pim->config.block_size = pim_client_block_size(pim->client);
+	return pim;
+}
+
+/**
+ * End the DPU handler threads of an instance and wait for the ranks still
+ * being recovered from a fault.
+ *
+ * @param pim: the instance, its threads may only be partly created
+ */
+static void stop_dispatchers(pim_ctx_t *pim) {
+	atomic_store(&pim->args.stop_thread, 1);
+	atomic_fetch_add(&pim->args.doorbell, 1);
+	futex_wake(&pim->args.doorbell, INT_MAX);
+	for (uint32_t i = 0; i < pim->nr_dispatchers; i++)
+		pthread_join(pim->dispatchers[i].thread, NULL);
+
+	for (uint32_t rank_id = 0; pim->ranks != NULL && rank_id < pim->num_ranks; rank_id++) {
+		if (pim->ranks[rank_id].recovery_started)
+			pthread_join(pim->ranks[rank_id].recovery_thread, NULL);
+	}
+}
+
+/**
+ * Free the DPUs and the memory of an instance whose threads are stopped.
+ *
+ * @param pim: the instance, may only be partly set up
+ */
+static void release_ctx(pim_ctx_t *pim) {
+	if (pim->dpus_allocated && dpu_free(pim->dpus) != DPU_OK)
+		fprintf(stderr, "Failed to free the DPUs\n");
+
+	for (uint32_t rank_id = 0; pim->ranks != NULL && rank_id < pim->num_ranks; rank_id++) {
+		host_rank_context *rank_ctx = &pim->ranks[rank_id];
+		if (rank_ctx->staging != NULL)
+			munmap(rank_ctx->staging, NR_MRAM_HALVES * rank_ctx->staging_size);
+		if (rank_ctx->output_staging != NULL)
+			munmap(rank_ctx->output_staging, rank_ctx->output_staging_size);
+		free(rank_ctx->dpus);
+		free(rank_ctx->descriptors);
+	}
+	free(pim->ranks);
+
+	free(pim->args.caller_args);
+	for (uint32_t i = 0; i < pim->args.nr_queues; i++) {
+		for (uint32_t priority = 0; priority < PIM_NR_PRIORITIES; priority++)
+			free(pim->args.queues[i].rings[priority].req_ring);
+	}
+	free(pim->args.queues);
+	free(pim->args.free_next);
+	free(pim->dispatchers);
+	free(pim);
+}
+
+/**
+ * Undo a pim_create that failed part way.
+ *
+ * @param pim: the instance being created
+ * @return NULL, for pim_create to return
+ */
+static pim_ctx_t *abort_create(pim_ctx_t *pim) {
+	stop_dispatchers(pim);
+	release_ctx(pim);
+	return NULL;
+}
+
+pim_ctx_t *pim_create(const pim_config_t *cfg) {
+	pim_ctx_t *pim = calloc(1, sizeof(pim_ctx_t));
+	if (pim == NULL)
+		return NULL;
+
+	if (cfg != NULL)
+		pim->config = *cfg;
+	else
+		pim_config_init(&pim->config);
+
+	if (pim->config.nr_tasklets == 0 || pim->config.nr_tasklets > MAX_NR_TASKLETS) {
+		fprintf(stderr, "Number of tasklets must be between 1 and %d\n", MAX_NR_TASKLETS);
+		free(pim);
+		return NULL;
+	}
+	if (pim->config.block_size == 0 || pim->config.block_size > MAX_OUTPUT_SIZE) {
+		fprintf(stderr, "Block size must be between 1 and %d\n", MAX_OUTPUT_SIZE);
+		free(pim);
+		return NULL;
+	}
+	// Blocks that do not compress must still fit the input buffer of a
+	// tasklet, Snappy sends every block up to the block size to the DPUs
+	if (MAX_COMPRESSED_LENGTH((uint64_t)pim->config.block_size) > MAX_INPUT_SIZE) {
+		fprintf(stderr, "Block size %u does not fit the DPU input buffer of %d bytes once compressed\n",
+			pim->config.block_size, MAX_INPUT_SIZE);
+		free(pim);
+		return NULL;
+	}
+	if (pim->config.batch_policy > PIM_BATCH_THROUGHPUT) {
+		fprintf(stderr, "Unknown batch policy %u\n", pim->config.batch_policy);
+		free(pim);
+		return NULL;
+	}
+	pim->nr_tasklets = pim->config.nr_tasklets;
+	pim->max_block_size = ALIGN(pim->config.block_size, 8);
+
+	// Small blocks are packed several to a tasklet, as many as are sure to
+	// fit its MRAM buffers even if they do not compress at all
+	uint32_t max_compressed = ALIGN(MAX_COMPRESSED_LENGTH(pim->config.block_size), 8);
+	uint32_t jobs_fit = MIN(MIN(MAX_INPUT_SIZE / max_compressed, MAX_OUTPUT_SIZE / pim->max_block_size), MAX_JOBS_PER_TASKLET);
+	if (pim->config.jobs_per_tasklet > MAX(jobs_fit, 1)) {
+		fprintf(stderr, "At most %u blocks of %u bytes fit in a tasklet\n", MAX(jobs_fit, 1), pim->config.block_size);
+		free(pim);
+		return NULL;
+	}
+	pim->jobs_per_tasklet = (pim->config.jobs_per_tasklet != 0) ? pim->config.jobs_per_tasklet : MAX(jobs_fit, 1);
+	pim->max_job_input = (MAX_INPUT_SIZE / pim->jobs_per_tasklet) & ~7u;
+	if (pim->config.requests_to_wait_for == 0)
+		pim->config.requests_to_wait_for = pim->nr_tasklets * REQUESTS_PER_TASKLET;
+
+	if (!get_dpu_program(pim, pim->program, sizeof(pim->program))) {
+		fprintf(stderr, "DPU program path too long\n");
+		free(pim);
+		return NULL;
+	}
+
+	// Allocate the DPUs, then check how many were allocated. Another
+	// instance may hold the ranks asked for, which is an error for the
+	// caller to handle
+	dpu_error_t err;
+	if (pim->config.nr_ranks == 0)
+		err = dpu_alloc(DPU_ALLOCATE_ALL, pim->config.dpu_profile, &pim->dpus);
+	else
+		err = dpu_alloc_ranks(pim->config.nr_ranks, pim->config.dpu_profile, &pim->dpus);
+	if (err != DPU_OK) {
+		fprintf(stderr, "Failed to allocate the DPUs, error %d\n", (int)err);
+		return abort_create(pim);
+	}
+	pim->dpus_allocated = true;
+
+	dpu_get_nr_ranks(pim->dpus, &pim->num_ranks);
+	dpu_get_nr_dpus(pim->dpus, &pim->num_dpus);
+	if (pim->num_ranks == 0) {
+		fprintf(stderr, "No DPU ranks allocated\n");
+		return abort_create(pim);
+	}
+	pim->dpus_per_rank = pim->num_dpus / pim->num_ranks;
+	pim->args.total_request_slots = pim->num_dpus * pim->nr_tasklets * pim->jobs_per_tasklet;
+
+	// Load the program to all DPUs
+	err = dpu_load(pim->dpus, pim->program, NULL);
+	if (err != DPU_OK) {
+		fprintf(stderr, "Failed to load %s, error %d\n", pim->program, (int)err);
+		return abort_create(pim);
+	}
+
+	// Set up the state shared by the DPU handler threads
+	atomic_init(&pim->args.stop_thread, 0);
+	atomic_init(&pim->args.doorbell, 0);
+	atomic_init(&pim->args.sleeping, 0);
+	// The adaptive policies want a wakeup once a whole rank can be filled
+	pim->args.launch_threshold = (pim->config.batch_policy == PIM_BATCH_FIXED) ? pim->config.requests_to_wait_for : pim->nr_tasklets * pim->dpus_per_rank * pim->jobs_per_tasklet;
+	atomic_init(&pim->args.space, 0);
+	atomic_init(&pim->args.space_waiters, 0);
+	atomic_init(&pim->args.completions, 0);
+	atomic_init(&pim->args.completion_waiters, 0);
+	atomic_init(&pim->args.service_ns, 0);
+	atomic_init(&pim->args.deadlines_waiting, 0);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_cpus = (cpus > 0) ? cpus : 1;
+	pthread_once(&cpu_nodes_once, read_cpu_nodes);
+	pim->args.caller_args = calloc(pim->args.total_request_slots, sizeof(*pim->args.caller_args));
+
+	// Every slot starts out free
+	pim->args.free_next = malloc(pim->args.total_request_slots * sizeof(*pim->args.free_next));
+	pim->ranks = calloc(pim->num_ranks, sizeof(host_rank_context));
+	pim->args.queues = calloc(pim->num_ranks, sizeof(request_queue_t));
+	pim->dispatchers = calloc(pim->num_ranks, sizeof(dispatcher_args_t));
+	if (pim->args.caller_args == NULL || pim->args.free_next == NULL || pim->ranks == NULL ||
+			pim->args.queues == NULL || pim->dispatchers == NULL) {
+		fprintf(stderr, "Failed to allocate the request buffers\n");
+		return abort_create(pim);
+	}
+	for (uint32_t i = 0; i < pim->args.total_request_slots; i++)
+		atomic_init(&pim->args.free_next[i], (i + 1 < pim->args.total_request_slots) ? i + 1 : FREE_SLOT_NONE);
+	atomic_init(&pim->args.free_head, 0);
+
+	// Find the NUMA node of every rank, and order the ranks by node so
+	// that the ranks of a node are consecutive
 	uint32_t rank_id = 0;
+	struct dpu_set_t dpu_rank;
+	DPU_RANK_FOREACH(pim->dpus, dpu_rank) {
+		pim->ranks[rank_id].rank = dpu_rank;
+		pim->ranks[rank_id].set_idx = rank_id;
+		pim->ranks[rank_id].node = rank_numa_node(dpu_rank);
+		rank_id++;
+	}
+	qsort(pim->ranks, pim->num_ranks, sizeof(host_rank_context), compare_rank_node);
+
+	// allocate space for dpu descriptors and a staging buffer on the node of every rank
+	for (rank_id = 0; rank_id < pim->num_ranks; rank_id++) {
+		host_rank_context *rank_ctx = &pim->ranks[rank_id];
+		rank_ctx->pim = pim;
+		rank_ctx->dpus = calloc(pim->dpus_per_rank, sizeof(struct host_dpu_descriptor));
+		atomic_init(&rank_ctx->batches_done, 0);
+		atomic_init(&rank_ctx->recovering, false);
+		rank_ctx->track = pim_trace_track("rank", rank_id);
+		rank_ctx->descriptors = calloc(NR_MRAM_HALVES * pim->dpus_per_rank * pim->nr_tasklets * MAX_JOBS_PER_TASKLET, sizeof(task_descriptor_t));
+
+		rank_ctx->staging_size = (size_t)pim->dpus_per_rank * MAX_INPUT_SIZE;
+		rank_ctx->staging = alloc_staging(NR_MRAM_HALVES * rank_ctx->staging_size, rank_ctx->node);
+		rank_ctx->output_staging_size = (size_t)pim->dpus_per_rank * pim->jobs_per_tasklet * pim->max_block_size;
+		rank_ctx->output_staging = alloc_staging(rank_ctx->output_staging_size, rank_ctx->node);
+		if (rank_ctx->dpus == NULL || rank_ctx->descriptors == NULL || rank_ctx->staging == NULL || rank_ctx->output_staging == NULL) {
+			fprintf(stderr, "Failed to allocate staging buffer for rank %u\n", rank_id);
+			return abort_create(pim);
+		}
+	}
+
+	// One request queue per node with ranks. Callers on a node without
+	// ranks are spread over the queues
+	pim->args.nr_queues = 0;
+	for (rank_id = 0; rank_id < pim->num_ranks; rank_id++) {
+		if (rank_id > 0 && pim->ranks[rank_id].node == pim->ranks[rank_id - 1].node)
+			continue;
+		request_queue_t *queue = &pim->args.queues[pim->args.nr_queues++];
+		queue->node = pim->ranks[rank_id].node;
+		for (uint32_t priority = 0; priority < PIM_NR_PRIORITIES; priority++) {
+			atomic_init(&queue->rings[priority].req_head, 0);
+			atomic_init(&queue->rings[priority].req_tail_dispatched, 0);
+			queue->rings[priority].req_ring = calloc(pim->args.total_request_slots, sizeof(*queue->rings[priority].req_ring));
+			if (queue->rings[priority].req_ring == NULL) {
+				fprintf(stderr, "Failed to allocate the request queues\n");
+				return abort_create(pim);
+			}
+		}
+	}
+	for (int node = 0; node < MAX_NUMA_NODES; node++)
+		pim->args.queue_of_node[node] = node % pim->args.nr_queues;
+	for (uint32_t i = 0; i < pim->args.nr_queues; i++)
+		pim->args.queue_of_node[pim->args.queues[i].node] = i;
+
+	pim->start_time = now_ns();
+
+	// Create the DPU handler threads, each one owns a pool of consecutive
+	// ranks of a single node and runs on the CPUs of that node. Every node
+	// gets threads in proportion to its ranks, at least one, and pool sizes
+	// of a node differ by at most one rank
+	uint32_t nr_dispatchers = (pim->config.nr_dispatchers == 0) ? pim->num_ranks : MIN(pim->config.nr_dispatchers, pim->num_ranks);
+	pim->nr_dispatchers = 0;
+	uint32_t first = 0;
+	for (uint32_t q = 0; q < pim->args.nr_queues; q++) {
+		uint32_t end = first;
+		while (end < pim->num_ranks && pim->ranks[end].node == pim->args.queues[q].node)
+			end++;
+		uint32_t node_ranks = end - first;
+		uint32_t node_dispatchers = MIN(MAX((uint64_t)nr_dispatchers * node_ranks / pim->num_ranks, 1), node_ranks);
+
+		pthread_attr_t attr;
+		cpu_set_t cpus;
+		pthread_attr_init(&attr);
+		if (numa_node_cpus(pim->args.queues[q].node, &cpus))
+			pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+
+		for (uint32_t j = 0; j < node_dispatchers; j++) {
+			dispatcher_args_t *dispatcher = &pim->dispatchers[pim->nr_dispatchers];
+			dispatcher->id = pim->nr_dispatchers;
+			dispatcher->first_rank = first + (uint64_t)j * node_ranks / node_dispatchers;
+			dispatcher->nr_ranks = first + (uint64_t)(j + 1) * node_ranks / node_dispatchers - dispatcher->first_rank;
+			dispatcher->queue = q;
+			dispatcher->pim = pim;
+			if (pthread_create(&dispatcher->thread, &attr, dpu_uncompress, dispatcher) != 0) {
+				fprintf(stderr, "Failed to create dpu_decompress pthreads\n");
+				pthread_attr_destroy(&attr);
+				return abort_create(pim);
+			}
+			pim->nr_dispatchers++;
+		}
+		pthread_attr_destroy(&attr);
+		first = end;
+	}
+
+	return pim;
+}
+
+void pim_deinit(void) {
+	pim_destroy(default_ctx);
+	default_ctx = NULL;
+}
+
+void pim_destroy(pim_ctx_t *pim) {
+	if (pim == NULL)
+		return;
+
+	if (pim->client != NULL) {
+		pim_client_disconnect(pim->client);
+		free(pim);
+		return;
+	}
+
+	// get DPU stats, the rank contexts are ordered by node so each one
+	// reports where it sits in the DPU set
 	double total_dpu_perf = 0.0;
-	DPU_RANK_FOREACH(dpus, dpu_rank) {
-		host_rank_context* rank_ctx = &ctx[rank_id];
+	for (uint32_t rank_id = 0; rank_id < pim->num_ranks; rank_id++) {
+		host_rank_context* rank_ctx = &pim->ranks[rank_id];
 		double max_perf_rank = 0.0;
-		for (uint32_t dpu_id=0; dpu_id < dpus_per_rank; dpu_id++) {
+		for (uint32_t dpu_id=0; dpu_id < pim->dpus_per_rank; dpu_id++) {
 			max_perf_rank = MAX((double)rank_ctx->dpus[dpu_id].perf/DPU_CLOCK_CYCLE, max_perf_rank);
 		}
-		printf("max runtime of all DPUs in rank %d: %lf\n", rank_id, max_perf_rank);
+		printf("max runtime of all DPUs in rank %u (rank %u of the DPU set, node %d): %lf\n",
+			rank_id, rank_ctx->set_idx, rank_ctx->node, max_perf_rank);
 		total_dpu_perf += max_perf_rank;
-		rank_id++;
 	}
 	printf("total runtime of all ranks %lf\n", total_dpu_perf);
-	printf("Total # of requests %d\n", args.req_total);
-	printf("Time it took to mem_cpy %f\n", memcpyTime);
+	printf("Total # of requests %lu\n", (unsigned long)requests_submitted(&pim->args));
+
+	// Terminate the DPU handler threads, and wait for the ranks still
+	// being recovered
+	stop_dispatchers(pim);
+
+	double memcpy_time = 0;
+	for (uint32_t i = 0; i < pim->nr_dispatchers; i++)
+		memcpy_time += pim->dispatchers[i].memcpy_time;
+	printf("Time it took to mem_cpy %f\n", memcpy_time);
 
-	// Signal to terminate the dpu master thread
-	pthread_mutex_lock(&mutex);
-	args.stop_thread = 1;
-	pthread_mutex_unlock(&mutex);
-	pthread_cond_broadcast(&dpu_cond);
+	if (atomic_load(&pim->rank_faults) != 0)
+		printf("DPU rank faults %lu, requests decompressed on the CPU instead %lu\n",
+			(unsigned long)atomic_load(&pim->rank_faults), (unsigned long)atomic_load(&pim->requests_recovered));
 
-	pthread_join(dpu_master_thread, NULL);
+	// Free the DPUs and all the allocated memory
+	release_ctx(pim);
+}
 
-	// Free the DPUs
-	DPU_ASSERT(dpu_free(dpus));
-	num_ranks = 0;
-	num_dpus = 0;
+int pim_decompress(pim_ctx_t *pim, const char *compressed, size_t compressed_length, char *uncompressed) {
+	return pim_decompress_ex(pim, compressed, compressed_length, uncompressed, NULL);
+}
 
-	// Free all the allocated memory
-	free(args.caller_args);
+int pim_decompress_ex(pim_ctx_t *pim, const char *compressed, size_t compressed_length, char *uncompressed, const pim_request_opts_t *opts) {
+	if (pim->client != NULL) {
+		pim_block_t block = { compressed, compressed_length, uncompressed, 0 };
+		return client_decompress(pim, &block, 1);
+	}
 
-	// Destroy the mutex
-	pthread_mutex_destroy(&mutex);
+	struct pim_request req;
+	if (!init_request(pim, &req, compressed, compressed_length, 0, uncompressed) || !set_request_opts(&req, opts))
+		return false;
+	if (prefer_cpu(pim, req.output.length) || misses_deadline(pim, &req.args))
+		return run_on_cpu(&req.input, &req.output);
 
-	// Destroy the condition variables
-	pthread_cond_destroy(&caller_cond);
-	pthread_cond_destroy(&dpu_cond);
+	submit_requests(pim, &req, 1, true);
+	return wait_request(pim, &req.args);
 }
 
-int pim_decompress(const char *compressed, size_t compressed_length, char *uncompressed) {
-	// Set up in the input and output buffers
-	host_buffer_context_t input = {
-		.buffer = (char *)compressed,
-		.curr   = (char *)compressed,
-		.length = compressed_length
-	};
-
-	host_buffer_context_t output = {
-		.buffer = uncompressed,
-		.curr   = uncompressed,
-		.length = 0
-	};
+int pim_decompress_padded(pim_ctx_t *pim, const char *compressed, size_t compressed_length, size_t padded_length, char *uncompressed) {
+	if (pim->client != NULL) {
+		pim_block_t block = { compressed, compressed_length, uncompressed, padded_length };
+		return client_decompress(pim, &block, 1);
+	}
 
-	// Read the decompressed length
-	if (!read_varint32(&input, &(output.length))) {
-		fprintf(stderr, "Failed to read decompressed length\n");
+	struct pim_request req;
+	if (!init_request(pim, &req, compressed, compressed_length, padded_length, uncompressed))
 		return false;
+	if (prefer_cpu(pim, req.output.length))
+		return run_on_cpu(&req.input, &req.output);
+
+	submit_requests(pim, &req, 1, true);
+	return wait_request(pim, &req.args);
+}
+
+int pim_try_decompress(pim_ctx_t *pim, const char *compressed, size_t compressed_length, char *uncompressed) {
+	if (pim->client != NULL) {
+		// The slots of the broker are shared by all of its clients
+		uint32_t slot;
+		int retval = pim_client_try_submit(pim->client, compressed, compressed_length, &slot);
+		if (retval != 1)
+			return retval;
+		return pim_client_wait(pim->client, slot, uncompressed);
 	}
 
-	// Set up the caller arguments
-	caller_args_t m_args = {
-		.data_ready = 1,
-		.input = &input,
-		.output = &output,
-		.retval = 0
-	};	
-	
-	pthread_mutex_lock(&mutex);
-
-	// Wait until there is space to take in more requests
-	while (args.req_count == total_request_slots) {
-		pthread_cond_wait(&caller_cond, &mutex);
-	}
-	
-	args.caller_args[args.req_head] = &m_args;
-	args.req_head = (args.req_head + 1) % total_request_slots;
-	args.req_count++;
-	args.req_waiting++;
-	args.req_total++;
-	pthread_cond_broadcast(&dpu_cond);
-
-	// Wait for request to be processed
-	while (m_args.data_ready != 0) {
-		pthread_cond_wait(&caller_cond, &mutex);
-	}
-
-	pthread_mutex_unlock(&mutex);
-	return m_args.retval;
+	struct pim_request req;
+	if (!init_request(pim, &req, compressed, compressed_length, 0, uncompressed))
+		return false;
+	if (prefer_cpu(pim, req.output.length))
+		return run_on_cpu(&req.input, &req.output);
+
+	if (submit_requests(pim, &req, 1, false) == 0)
+		return -EAGAIN;
+	return wait_request(pim, &req.args);
+}
+
+int pim_decompress_batch(pim_ctx_t *pim, const pim_block_t *blocks, size_t n) {
+	return pim_decompress_batch_ex(pim, blocks, n, NULL);
+}
+
+int pim_decompress_batch_ex(pim_ctx_t *pim, const pim_block_t *blocks, size_t n, const pim_request_opts_t *opts) {
+	if (n == 0)
+		return true;
+	if (pim->client != NULL)
+		return client_decompress(pim, blocks, n);
+
+	struct pim_request *reqs = malloc(n * sizeof(struct pim_request));
+	if (reqs == NULL)
+		return false;
+
+	// Set up every block, blocks with an invalid header are never submitted
+	atomic_uint remaining;
+	int retval = true;
+	size_t count = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (!init_request(pim, &reqs[count], blocks[i].compressed, blocks[i].compressed_length, blocks[i].padded_length, blocks[i].uncompressed) ||
+				!set_request_opts(&reqs[count], opts)) {
+			retval = false;
+			continue;
+		}
+		reqs[count].args.batch_remaining = &remaining;
+		count++;
+	}
+	atomic_init(&remaining, count);
+
+	// The blocks share a deadline, if the DPUs cannot make it for the first
+	// one they cannot for the others either
+	if (count != 0 && misses_deadline(pim, &reqs[0].args)) {
+		for (size_t i = 0; i < count; i++)
+			retval &= (run_on_cpu(&reqs[i].input, &reqs[i].output) == 1);
+		free(reqs);
+		return retval;
+	}
+
+	submit_requests(pim, reqs, count, true);
+
+	// Wait for the whole batch to be processed
+	uint32_t left;
+	while ((left = atomic_load_explicit(&remaining, memory_order_acquire)) != 0) {
+		if (!steal_request(pim))
+			futex_wait(&remaining, left, NULL);
+	}
+	pim_trace_mark("wakeup", count, 0);
+
+	for (size_t i = 0; i < count; i++)
+		retval &= (reqs[i].args.retval == 1);
+
+	free(reqs);
+	return retval;
+}
+
+int pim_decompress_async(pim_ctx_t *pim, const char *compressed, size_t compressed_length, char *uncompressed, pim_handle_t *handle) {
+	return pim_decompress_async_ex(pim, compressed, compressed_length, uncompressed, NULL, handle);
+}
+
+int pim_decompress_async_ex(pim_ctx_t *pim, const char *compressed, size_t compressed_length, char *uncompressed, const pim_request_opts_t *opts, pim_handle_t *handle) {
+	*handle = NULL;
+
+	struct pim_request *req = malloc(sizeof(struct pim_request));
+	if (req == NULL)
+		return false;
+
+	if (pim->client != NULL) {
+		// Only the slot and where the output goes are needed to finish it
+		req->pim = pim;
+		req->output.buffer = uncompressed;
+		if (!pim_client_submit(pim->client, compressed, compressed_length, &req->args.slot)) {
+			free(req);
+			return false;
+		}
+		*handle = req;
+		return true;
+	}
+
+	if (!init_request(pim, req, compressed, compressed_length, 0, uncompressed) || !set_request_opts(req, opts)) {
+		free(req);
+		return false;
+	}
+
+	// A request that would miss its deadline is done before returning, the
+	// handle is already complete
+	if (misses_deadline(pim, &req->args)) {
+		req->args.retval = run_on_cpu(&req->input, &req->output);
+		atomic_store(&req->args.data_ready, 0);
+		*handle = req;
+		return true;
+	}
+
+	submit_requests(pim, req, 1, true);
+	*handle = req;
+	return true;
+}
+
+int pim_poll(pim_handle_t handle) {
+	if (handle->pim->client != NULL)
+		return pim_client_poll(handle->pim->client, handle->args.slot);
+	return (atomic_load_explicit(&handle->args.data_ready, memory_order_acquire) == 0);
+}
+
+int pim_wait(pim_handle_t handle) {
+	int retval;
+	if (handle->pim->client != NULL)
+		retval = pim_client_wait(handle->pim->client, handle->args.slot, handle->output.buffer);
+	else
+		retval = wait_request(handle->pim, &handle->args);
+	free(handle);
+	return retval;
+}
+
+long pim_wait_any(pim_ctx_t *pim, const pim_handle_t *handles, size_t count) {
+	bool any = false;
+	for (size_t i = 0; i < count; i++)
+		any |= (handles[i] != NULL);
+	if (!any)
+		return -1;
+
+	// A broker counts completions in its shared segment
+	atomic_uint *completions_word = &pim->args.completions;
+	atomic_uint *waiters = &pim->args.completion_waiters;
+	if (pim->client != NULL)
+		completions_word = pim_client_completions(pim->client, &waiters);
+
+	atomic_fetch_add(waiters, 1);
+	for (;;) {
+		// Read the counter before checking so a completion in between wakes us
+		uint32_t completions = atomic_load(completions_word);
+		for (size_t i = 0; i < count; i++) {
+			if (handles[i] != NULL && pim_poll(handles[i])) {
+				atomic_fetch_sub(waiters, 1);
+				return (long)i;
+			}
+		}
+		if (pim->client != NULL)
+			pim_broker_futex_wait(completions_word, completions, NULL);
+		else if (!steal_request(pim))
+			futex_wait(completions_word, completions, NULL);
+	}
+}
+
+void pim_set_cpu_decompressor(pim_cpu_decompress_fn decompress) {
+	atomic_store(&cpu_decompressor, decompress);
+}
+
+size_t pim_get_block_size(const pim_ctx_t *pim) {
+	// Zero without an instance, so everything stays on the CPU
+	return (pim != NULL) ? pim->config.block_size : 0;
+}
+
+unsigned pim_get_stats(const pim_ctx_t *pim, pim_stats_t *stats, pim_rank_stats_t *ranks, unsigned max_ranks) {
+	memset(stats, 0, sizeof(*stats));
+	if (pim == NULL || pim->client != NULL)
+		return 0;
+
+	uint64_t elapsed_ns = now_ns() - pim->start_time;
+	stats->elapsed_s = elapsed_ns / 1e9;
+	for (uint32_t stage = 0; stage < PIM_NR_STAGES; stage++) {
+		const histogram_t *hist = &pim->latency[stage];
+		stats->latency[stage].count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+		stats->latency[stage].sum_ns = atomic_load_explicit(&hist->sum_ns, memory_order_relaxed);
+		for (uint32_t bucket = 0; bucket < PIM_HIST_BUCKETS; bucket++)
+			stats->latency[stage].buckets[bucket] = atomic_load_explicit(&hist->buckets[bucket], memory_order_relaxed);
+	}
+
+	stats->batches = atomic_load(&pim->batches);
+	stats->requests = atomic_load(&pim->requests);
+	uint64_t capacity = atomic_load(&pim->batch_capacity);
+	stats->batch_fill = capacity ? (double)stats->requests / capacity : 0.0;
+	stats->input_bytes = atomic_load(&pim->input_bytes);
+	stats->output_bytes = atomic_load(&pim->output_bytes);
+	stats->padding_bytes = atomic_load(&pim->padding_bytes);
+	if (elapsed_ns != 0) {
+		stats->input_bytes_per_s = stats->input_bytes / stats->elapsed_s;
+		stats->output_bytes_per_s = stats->output_bytes / stats->elapsed_s;
+	}
+	pim_get_fault_stats(pim, &stats->faults);
+
+	// A rank is busy from its launch until it is unloaded, the batches still
+	// running only count once they are
+	for (uint32_t rank_id = 0; ranks != NULL && rank_id < MIN(max_ranks, pim->num_ranks); rank_id++) {
+		const host_rank_context *rank_ctx = &pim->ranks[rank_id];
+		ranks[rank_id].utilization = elapsed_ns ? (double)atomic_load(&rank_ctx->busy_ns) / elapsed_ns : 0.0;
+		ranks[rank_id].batches = atomic_load(&rank_ctx->batches);
+		ranks[rank_id].requests = atomic_load(&rank_ctx->requests);
+	}
+	return pim->num_ranks;
+}
+
+void pim_get_fault_stats(const pim_ctx_t *pim, pim_fault_stats_t *stats) {
+	memset(stats, 0, sizeof(*stats));
+	if (pim == NULL || pim->client != NULL)
+		return;
+
+	stats->rank_faults = atomic_load(&pim->rank_faults);
+	stats->requests_recovered = atomic_load(&pim->requests_recovered);
+	stats->rank_reloads = atomic_load(&pim->rank_reloads);
+	for (uint32_t rank_id = 0; rank_id < pim->num_ranks; rank_id++)
+		stats->ranks_out_of_service += atomic_load(&pim->ranks[rank_id].recovering);
+}
+
+void *pim_alloc_input(size_t size) {
+	void *buffer;
+	if (posix_memalign(&buffer, 64, size + PIM_INPUT_PADDING) != 0)
+		return NULL;
+	return buffer;
+}
+
+void pim_free_input(void *buffer) {
+	free(buffer);
 }
@@ -1,33 +1,441 @@
 #ifndef _PIM_SNAPPY_H_
 #define _PIM_SNAPPY_H_
 
+#include <stddef.h>
+
+// Number of bytes past the end of the data that can be read from a buffer
+// returned by pim_alloc_input
+#define PIM_INPUT_PADDING (256 * 1024)
+
+// Number of buckets of a pim_histogram_t, the last one holds every latency
+// of 2^(PIM_HIST_BUCKETS - 1) ns and more
+#define PIM_HIST_BUCKETS 40
+
 #ifdef __cplusplus
 	extern "C" {
 #endif
 		/**
-		 * Initialize the PIM-assisted Snappy decompressor. Allocates all DPUs, creates the DPU handler
-		 * thread and the request buffer.
+		 * An instance of the decompressor: a set of ranks with their own request queue, DPU handler
+		 * threads and runtime parameters. Several instances can coexist in a process.
+		 */
+		typedef struct pim_ctx pim_ctx_t;
+
+		/**
+		 * Handle to a request submitted with pim_decompress_async.
+		 */
+		typedef struct pim_request *pim_handle_t;
+
+		/**
+		 * A compressed block submitted through pim_decompress_batch.
+		 */
+		typedef struct pim_block {
+			const char *compressed;   // pointer to the compressed data stream
+			size_t compressed_length; // length in bytes of the compressed data stream
+			char *uncompressed;       // pointer to where the decompressed data stream should be stored
+			size_t padded_length;     // number of bytes that can be read from compressed, 0 if not padded
+		} pim_block_t;
+
+		/**
+		 * How the DPU handler threads decide when to launch a rank that is not full.
+		 */
+		typedef enum pim_batch_policy {
+			PIM_BATCH_FIXED = 0,      // launch at requests_to_wait_for requests or after max_time_wait_ms
+			PIM_BATCH_LATENCY = 1,    // wait for a full rank only while latency_target_us can still be met
+			PIM_BATCH_THROUGHPUT = 2, // wait for a full rank unless filling it takes longer than serving it
+		} pim_batch_policy_t;
+
+		/**
+		 * Priority class of a request. The DPU handler threads fill launches with the waiting
+		 * requests of the highest class first, and launch high priority requests without waiting
+		 * for a fuller batch.
+		 */
+		typedef enum pim_priority {
+			PIM_PRIORITY_HIGH = 0,   // interactive requests, like point lookups
+			PIM_PRIORITY_NORMAL = 1, // the default
+			PIM_PRIORITY_LOW = 2,    // bulk work, like full scans
+			PIM_NR_PRIORITIES = 3,
+		} pim_priority_t;
+
+		/**
+		 * Options of a request submitted with one of the _ex functions.
+		 */
+		typedef struct pim_request_opts {
+			unsigned priority;    // one of pim_priority_t
+			unsigned deadline_us; // time from submission the request should be done in, 0 for none. A request
+			                      // with a deadline is launched without waiting for a fuller batch, and is
+			                      // decompressed on the CPU instead if the DPUs are not expected to make it
+		} pim_request_opts_t;
+
+		/**
+		 * Decompresses a whole Snappy block on the CPU. The input may be in memory other processes
+		 * can write to, like the segment of a broker, so the length header is read only once: a
+		 * block whose header does not give uncompressed_length fails, and no more than
+		 * uncompressed_length bytes are ever written.
+		 *
+		 * @returns non-zero if decompression succeeded, 0 otherwise
+		 */
+		typedef int (*pim_cpu_decompress_fn)(const char *compressed, size_t compressed_length, char *uncompressed, size_t uncompressed_length);
+
+		/**
+		 * Runtime parameters of the PIM-assisted Snappy decompressor. For the default instance, each
+		 * one can be overridden with the environment variable named next to it.
+		 */
+		typedef struct pim_config {
+			unsigned nr_ranks;             // PIM_NR_RANKS: ranks to allocate, 0 for all
+			unsigned nr_tasklets;          // PIM_NR_TASKLETS: tasklets per DPU, selects the DPU program
+			unsigned nr_dispatchers;       // PIM_NR_DISPATCHERS: DPU handler threads, 0 for one per rank
+			unsigned requests_to_wait_for; // PIM_REQUESTS_TO_WAIT_FOR: waiting requests that trigger a launch, 0 for 64 per tasklet
+			unsigned max_time_wait_ms;     // PIM_MAX_TIME_WAIT_MS: longest time to wait before launching fewer requests
+			unsigned batch_policy;         // PIM_BATCH_POLICY: one of pim_batch_policy_t
+			unsigned latency_target_us;    // PIM_LATENCY_TARGET_US: latency to aim for with PIM_BATCH_LATENCY
+			unsigned hybrid;               // PIM_HYBRID: 1 to also decompress on the CPU when it finishes sooner
+			unsigned jobs_per_tasklet;     // PIM_JOBS_PER_TASKLET: blocks a tasklet decompresses per launch, 0 for as many as fit
+			unsigned block_size;           // PIM_BLOCK_SIZE: largest decompressed block sent to the DPUs
+			const char *dpu_program;       // PIM_DPU_PROGRAM: DPU program path, "%u" is replaced by nr_tasklets,
+			                               // NULL for the program built with the library
+			const char *dpu_profile;       // PIM_DPU_PROFILE: profile given to dpu_alloc, e.g. "backend=simulator"
+			unsigned caller_credits;       // PIM_CALLER_CREDITS: requests a thread can have in flight, 0 for no limit
+		} pim_config_t;
+
+		/**
+		 * Counters of the faults on the ranks of an instance. The requests on a rank that faults
+		 * are decompressed on the CPU, and the rank is out of service until its program is loaded
+		 * again.
+		 */
+		typedef struct pim_fault_stats {
+			unsigned long rank_faults;        // faults seen on the ranks
+			unsigned long requests_recovered; // requests of faulted ranks decompressed on the CPU instead
+			unsigned long rank_reloads;       // faulted ranks put back in service
+			unsigned ranks_out_of_service;    // ranks being recovered, or that could not be loaded again
+		} pim_fault_stats_t;
+
+		/**
+		 * Stages of a request the latency statistics are kept for.
+		 */
+		typedef enum pim_stage {
+			PIM_STAGE_QUEUE_WAIT = 0,   // from submission until a DPU handler thread takes the request
+			PIM_STAGE_STAGING = 1,      // copying the inputs of the batch to the staging buffer
+			PIM_STAGE_TRANSFER_IN = 2,  // pushing the batch to the rank, only the queueing if the rank is running
+			PIM_STAGE_DPU = 3,          // running the batch, from the cycle counters of its DPUs
+			PIM_STAGE_TRANSFER_OUT = 4, // reading the outputs of the batch back
+			PIM_STAGE_END_TO_END = 5,   // from submission until the caller is handed the output
+			PIM_NR_STAGES = 6,
+		} pim_stage_t;
+
+		/**
+		 * Log-bucketed latency histogram.
+		 */
+		typedef struct pim_histogram {
+			unsigned long count;                     // number of samples
+			unsigned long sum_ns;                    // sum of the samples, for the mean
+			unsigned long buckets[PIM_HIST_BUCKETS]; // buckets[i] counts samples of [2^i, 2^(i+1)) ns, buckets[0] also 0 ns
+		} pim_histogram_t;
+
+		/**
+		 * Statistics of one rank of an instance.
+		 */
+		typedef struct pim_rank_stats {
+			double utilization;     // fraction of the time since the instance was created the rank had batches running
+			unsigned long batches;  // batches launched on the rank
+			unsigned long requests; // requests launched on the rank
+		} pim_rank_stats_t;
+
+		/**
+		 * Statistics of an instance since it was created.
+		 */
+		typedef struct pim_stats {
+			double elapsed_s;                       // time since the instance was created
+			pim_histogram_t latency[PIM_NR_STAGES]; // latency of each pim_stage_t, one sample per request
+			unsigned long batches;                  // batches launched on all ranks
+			unsigned long requests;                 // requests launched on all ranks
+			double batch_fill;                      // requests launched over the blocks the batches could hold
+			unsigned long input_bytes;              // compressed bytes sent to the DPUs
+			unsigned long output_bytes;             // decompressed bytes read back from the DPUs
+			unsigned long padding_bytes;            // bytes transferred only to give every DPU of a tasklet row the same length
+			double input_bytes_per_s;               // input_bytes over elapsed_s
+			double output_bytes_per_s;              // output_bytes over elapsed_s
+			pim_fault_stats_t faults;               // same as pim_get_fault_stats
+		} pim_stats_t;
+
+		/**
+		 * Fill a configuration with the defaults the library was built with.
+		 *
+		 * @param config: configuration to fill
+		 */
+		void pim_config_init(pim_config_t *config);
+
+		/**
+		 * Create an instance of the PIM-assisted Snappy decompressor. Allocates config->nr_ranks
+		 * ranks, creates the DPU handler threads and the request buffer. The environment is not
+		 * read, the parameters are used as given.
+		 *
+		 * @param config: parameters to use, NULL for the defaults
+		 * @returns the instance, NULL if there was an error
+		 */
+		pim_ctx_t *pim_create(const pim_config_t *config);
+
+		/**
+		 * Connect to a broker process that owns the DPUs, see pim_broker. The instance forwards
+		 * its requests to the broker through shared memory, so several processes share the ranks
+		 * and the DPU program is only loaded once.
+		 *
+		 * @param name: name of the shared memory segment of the broker
+		 * @returns the instance, NULL if no broker is running under that name
+		 */
+		pim_ctx_t *pim_connect(const char *name);
+
+		/**
+		 * Destroy an instance of the PIM-assisted Snappy decompressor. Deallocates its DPUs and
+		 * frees all of its dynamic memory. No request may be in flight on it.
+		 *
+		 * @param pim: the instance, may be NULL
+		 */
+		void pim_destroy(pim_ctx_t *pim);
+
+		/**
+		 * Initialize the default instance of the PIM-assisted Snappy decompressor, the one
+		 * pim_get_default returns. Allocates all DPUs, creates the DPU handler thread and the request
+		 * buffer. If PIM_BROKER is set, connects to the broker it names instead.
 		 *
 		 * @returns 0 if initialization was successful, -1 if there was an error
 		 */
 		int pim_init(void);
 
 		/**
-		 * Deinitialize the PIM-assisted Snappy decompressor. Deallocates all DPUs and frees all dynamic 
-		 * memory.
+		 * Initialize the default instance with runtime parameters. Environment variables override
+		 * the values in config. The DPUs are always allocated by this process.
+		 *
+		 * @param config: parameters to use, NULL for the defaults
+		 * @returns 0 if initialization was successful, -1 if there was an error
+		 */
+		int pim_init_ex(const pim_config_t *config);
+
+		/**
+		 * Get the default instance.
+		 *
+		 * @returns the instance, NULL if it is not initialized
+		 */
+		pim_ctx_t *pim_get_default(void);
+
+		/**
+		 * Get the largest decompressed block that can be submitted to an instance.
+		 *
+		 * @param pim: the instance, may be NULL
+		 * @returns the block size in bytes, 0 if pim is NULL
+		 */
+		size_t pim_get_block_size(const pim_ctx_t *pim);
+
+		/**
+		 * Get the fault counters of an instance. They are all zero for an instance connected to a
+		 * broker, the broker handles the faults of its ranks.
+		 *
+		 * @param pim: the instance, may be NULL
+		 * @param stats: filled with the counters
+		 */
+		void pim_get_fault_stats(const pim_ctx_t *pim, pim_fault_stats_t *stats);
+
+		/**
+		 * Get the statistics of an instance. Can be called at any time from any thread, while
+		 * requests are running the counters are read one at a time, so they may be a few requests
+		 * apart. They are all zero for an instance connected to a broker.
+		 *
+		 * @param pim: the instance, may be NULL
+		 * @param stats: filled with the statistics of the instance
+		 * @param ranks: filled with the statistics of the first max_ranks ranks, may be NULL
+		 * @param max_ranks: number of entries in ranks
+		 * @returns the number of ranks of the instance
+		 */
+		unsigned pim_get_stats(const pim_ctx_t *pim, pim_stats_t *stats, pim_rank_stats_t *ranks, unsigned max_ranks);
+
+		/**
+		 * Register the CPU decompressor used in hybrid mode by every instance. Blocks are routed to
+		 * it when the cost model expects it to finish them before the DPUs, and callers waiting on
+		 * requests use it to take over requests still waiting for a rank.
+		 *
+		 * @param decompress: the CPU decompressor, NULL to stop using the CPU
+		 */
+		void pim_set_cpu_decompressor(pim_cpu_decompress_fn decompress);
+
+		/**
+		 * Register the Snappy CPU decompressor with pim_set_cpu_decompressor. Snappy registers it
+		 * the first time it decompresses a block, processes that only hand blocks to the library,
+		 * like the broker, call this up front instead.
+		 */
+		void pim_use_snappy_cpu_decompressor(void);
+
+		/**
+		 * Deinitialize the default instance. Deallocates all DPUs and frees all dynamic memory.
 		 */
 		void pim_deinit(void);
 
 		/**
 		 * Performs Snappy decompression using PIM by submitting a request to the DPU handler thread
-		 * and waiting for the data to be processed and returned.
+		 * and waiting for the data to be processed and returned. The decompressed length of a block
+		 * can be at most pim_get_block_size().
+		 *
+		 * @param pim: the instance to use
+		 * @param compressed: pointer to the compressed data stream
+		 * @param compressed_length: length in bytes of the compressed data stream
+		 * @param uncompressed: pointer to where the decompressed data stream should be stored
+		 * @returns 1 if successful, 0 if there was an error
+		 */
+		int pim_decompress(pim_ctx_t *pim, const char *compressed, size_t compressed_length, char *uncompressed);
+
+		/**
+		 * Same as pim_decompress, for compressed data that is followed by readable padding. If the
+		 * data after the length header is 8-byte aligned and padded far enough, it is transferred to
+		 * the DPU straight from this buffer instead of being copied to a staging buffer first.
+		 *
+		 * @param pim: the instance to use
+		 * @param compressed: pointer to the compressed data stream
+		 * @param compressed_length: length in bytes of the compressed data stream
+		 * @param padded_length: number of bytes that can be read from compressed, at least compressed_length
+		 * @param uncompressed: pointer to where the decompressed data stream should be stored
+		 * @returns 1 if successful, 0 if there was an error
+		 */
+		int pim_decompress_padded(pim_ctx_t *pim, const char *compressed, size_t compressed_length, size_t padded_length, char *uncompressed);
+
+		/**
+		 * Same as pim_decompress, with a priority class and a deadline. An instance connected to a
+		 * broker serves every request in order and ignores the options.
+		 *
+		 * @param pim: the instance to use
+		 * @param compressed: pointer to the compressed data stream
+		 * @param compressed_length: length in bytes of the compressed data stream
+		 * @param uncompressed: pointer to where the decompressed data stream should be stored
+		 * @param opts: priority class and deadline of the request, NULL for the defaults
+		 * @returns 1 if successful, 0 if there was an error
+		 */
+		int pim_decompress_ex(pim_ctx_t *pim, const char *compressed, size_t compressed_length, char *uncompressed, const pim_request_opts_t *opts);
+
+		/**
+		 * Same as pim_decompress, but returns right away instead of waiting when the instance has no
+		 * free request slot or the calling thread has used up its caller_credits. The caller can then
+		 * decompress the block on the CPU instead. An instance connected to a broker returns right
+		 * away when the broker has no free slot.
+		 *
+		 * @param pim: the instance to use
+		 * @param compressed: pointer to the compressed data stream
+		 * @param compressed_length: length in bytes of the compressed data stream
+		 * @param uncompressed: pointer to where the decompressed data stream should be stored
+		 * @returns 1 if successful, 0 if there was an error, -EAGAIN if the block was not submitted
+		 */
+		int pim_try_decompress(pim_ctx_t *pim, const char *compressed, size_t compressed_length, char *uncompressed);
+
+		/**
+		 * Performs Snappy decompression of a set of blocks using PIM. All blocks are submitted to
+		 * the DPU handler thread together and the caller is woken once, when the last one is done.
+		 *
+		 * @param pim: the instance to use
+		 * @param blocks: array of blocks to decompress
+		 * @param n: number of blocks in the array
+		 * @returns 1 if every block was successful, 0 if there was an error with any of them
+		 */
+		int pim_decompress_batch(pim_ctx_t *pim, const pim_block_t *blocks, size_t n);
+
+		/**
+		 * Same as pim_decompress_batch, with a priority class and a deadline shared by every block.
+		 *
+		 * @param pim: the instance to use
+		 * @param blocks: array of blocks to decompress
+		 * @param n: number of blocks in the array
+		 * @param opts: priority class and deadline of the blocks, NULL for the defaults
+		 * @returns 1 if every block was successful, 0 if there was an error with any of them
+		 */
+		int pim_decompress_batch_ex(pim_ctx_t *pim, const pim_block_t *blocks, size_t n, const pim_request_opts_t *opts);
+
+		/**
+		 * Submits a Snappy decompression request to the DPU handler thread without waiting for it
+		 * to be processed. The compressed and uncompressed buffers must stay valid until the request
+		 * is released with pim_wait.
+		 *
+		 * @param pim: the instance to use
+		 * @param compressed: pointer to the compressed data stream
+		 * @param compressed_length: length in bytes of the compressed data stream
+		 * @param uncompressed: pointer to where the decompressed data stream should be stored
+		 * @param handle: set to the handle of the request, NULL if there was an error
+		 * @returns 1 if the request was submitted, 0 if there was an error
+		 */
+		int pim_decompress_async(pim_ctx_t *pim, const char *compressed, size_t compressed_length, char *uncompressed, pim_handle_t *handle);
+
+		/**
+		 * Same as pim_decompress_async, with a priority class and a deadline. A request that would
+		 * miss its deadline on the DPUs is decompressed on the CPU before returning, and its handle
+		 * is already complete.
 		 *
+		 * @param pim: the instance to use
 		 * @param compressed: pointer to the compressed data stream
 		 * @param compressed_length: length in bytes of the compressed data stream
 		 * @param uncompressed: pointer to where the decompressed data stream should be stored
+		 * @param opts: priority class and deadline of the request, NULL for the defaults
+		 * @param handle: set to the handle of the request, NULL if there was an error
+		 * @returns 1 if the request was submitted, 0 if there was an error
+		 */
+		int pim_decompress_async_ex(pim_ctx_t *pim, const char *compressed, size_t compressed_length, char *uncompressed, const pim_request_opts_t *opts, pim_handle_t *handle);
+
+		/**
+		 * Checks whether a request has been processed, without blocking.
+		 *
+		 * @param handle: handle returned by pim_decompress_async
+		 * @returns 1 if the request is done, 0 if it is still in flight
+		 */
+		int pim_poll(pim_handle_t handle);
+
+		/**
+		 * Waits for a request to be processed and releases its handle.
+		 *
+		 * @param handle: handle returned by pim_decompress_async, invalid once this returns
 		 * @returns 1 if successful, 0 if there was an error
 		 */
-		int pim_decompress(const char *compressed, size_t compressed_length, char *uncompressed);
+		int pim_wait(pim_handle_t handle);
+
+		/**
+		 * Waits until at least one of a set of requests has been processed. The handle is not
+		 * released, call pim_wait on it to get its result.
+		 *
+		 * @param pim: the instance the requests were submitted to
+		 * @param handles: array of handles returned by pim_decompress_async, NULL entries are skipped
+		 * @param count: number of entries in handles
+		 * @returns index of a processed request, -1 if handles has no valid entries
+		 */
+		long pim_wait_any(pim_ctx_t *pim, const pim_handle_t *handles, size_t count);
+
+		/**
+		 * Allocates a buffer for compressed data that can be transferred to the DPUs without a copy.
+		 * The buffer is 64-byte aligned and followed by PIM_INPUT_PADDING readable bytes, so data at
+		 * offset off can be submitted with a padded_length of (size + PIM_INPUT_PADDING - off).
+		 *
+		 * @param size: size of the buffer in bytes
+		 * @returns the buffer, or NULL if it could not be allocated
+		 */
+		void *pim_alloc_input(size_t size);
+
+		/**
+		 * Frees a buffer returned by pim_alloc_input.
+		 *
+		 * @param buffer: the buffer to free
+		 */
+		void pim_free_input(void *buffer);
+
+		/**
+		 * Event recorder for the timeline of the decompressor and its callers. It is off unless
+		 * PIM_TRACE names a file, which then gets a Chrome trace of the last PIM_TRACE_EVENTS events
+		 * of every thread, written when the thread exits or at exit, to be opened in chrome://tracing
+		 * or Perfetto. The DPU handler threads record
+		 * their rank loads and unloads and every rank gets a track showing when it runs, callers
+		 * can add their own spans with these. Names must be string literals.
+		 */
+		void pim_trace_begin(const char *name, unsigned long arg);
+		void pim_trace_end(const char *name);
+		void pim_trace_instant(const char *name, unsigned long arg);
+
+		/**
+		 * Name the timeline of the calling thread, like "reader 3".
+		 *
+		 * @param name: name of the thread, a number is appended to it
+		 * @param idx: the number
+		 */
+		void pim_trace_thread_name(const char *name, unsigned idx);
 #ifdef __cplusplus
 	}
 #endif
@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "pim_snappy.h"
+#include "pim_trace.h"
+
+// First track id handed out by pim_trace_track, above any thread id
+#define FIRST_TRACK (1 << 22)
+
+// An event of the timeline, see the Chrome trace event format
+typedef struct trace_event {
+	uint64_t ts_ns;   // Start of the event
+	uint64_t dur_ns;  // Length of a span recorded with pim_trace_complete
+	const char *name; // Name of the event
+	uint64_t arg;     // Value shown with the event
+	int32_t track;    // Track the event is drawn on, 0 for the thread that recorded it
+	char phase;       // 'B', 'E', 'X' or 'i'
+} trace_event_t;
+
+// Events of one thread, or the name of a track when events is NULL
+//
+// Only the owning thread writes to its ring, so recording an event takes no
+// lock. A thread writes its events to the trace file when it exits and its
+// ring goes to the next thread that records one, so short-lived threads do
+// not each keep a ring until the end. The rings of the threads still running
+// are written at exit.
+typedef struct trace_buffer {
+	struct trace_buffer *next; // Next buffer of the list
+	int32_t tid;               // Thread or track id
+	char name[32];             // Name of the thread or track, empty if unnamed
+	uint64_t head;             // Events recorded, the ring holds the last ring_events
+	trace_event_t *events;     // Ring of events, NULL for a track
+} trace_buffer_t;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static const char *trace_path;         // File the trace is written to, NULL if tracing is off
+static size_t ring_events = PIM_TRACE_EVENTS; // Events kept for each thread
+static uint64_t trace_start;           // Time of the first event, timestamps are relative to it
+static pthread_key_t trace_key;        // Buffer of each thread, written out by flush_thread
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;               // Trace being written, NULL once closed, guarded by trace_lock
+static bool trace_empty = true;        // No event written to trace_file yet, guarded by trace_lock
+static trace_buffer_t *trace_buffers;  // Running threads and tracks, guarded by trace_lock
+static trace_buffer_t *free_buffers;   // Rings of exited threads, guarded by trace_lock
+static atomic_int next_track = FIRST_TRACK;
+static __thread trace_buffer_t *thread_buffer;
+static __thread char thread_name[32];  // Name of the thread, given to its buffer once it has one
+
+
+static inline uint64_t trace_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Add a buffer to the list written out at exit, reusing the ring of an
+ * exited thread if there is one.
+ *
+ * @param tid: thread or track id
+ * @param with_events: True to give the buffer a ring of events
+ * @return the buffer, NULL if it could not be allocated
+ */
+static trace_buffer_t *add_buffer(int32_t tid, bool with_events)
+{
+	trace_buffer_t *buf = NULL;
+	pthread_mutex_lock(&trace_lock);
+	if (with_events && free_buffers != NULL) {
+		buf = free_buffers;
+		free_buffers = buf->next;
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	if (buf == NULL) {
+		buf = calloc(1, sizeof(trace_buffer_t));
+		if (buf == NULL)
+			return NULL;
+		if (with_events) {
+			buf->events = malloc(ring_events * sizeof(trace_event_t));
+			if (buf->events == NULL) {
+				free(buf);
+				return NULL;
+			}
+		}
+	}
+	buf->tid = tid;
+	buf->head = 0;
+	buf->name[0] = '\0';
+
+	pthread_mutex_lock(&trace_lock);
+	buf->next = trace_buffers;
+	trace_buffers = buf;
+	pthread_mutex_unlock(&trace_lock);
+	return buf;
+}
+
+/**
+ * Write a string to the trace, escaped for JSON.
+ */
+static void write_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', f);
+		if ((unsigned char)*s >= 0x20)
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/**
+ * Write the name and the events of a buffer to the trace, in the Chrome
+ * trace event format that chrome://tracing and Perfetto open. Called with
+ * trace_lock held.
+ *
+ * @param buf: the buffer
+ */
+static void write_buffer(trace_buffer_t *buf)
+{
+	FILE *f = trace_file;
+	if (f == NULL)
+		return;
+
+	int pid = getpid();
+	if (buf->name[0] != '\0') {
+		fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+			trace_empty ? "" : ",\n", pid, buf->tid);
+		write_string(f, buf->name);
+		fprintf(f, "}}");
+		trace_empty = false;
+	}
+	if (buf->events == NULL)
+		return;
+
+	uint64_t head = buf->head;
+	uint64_t tail = (head > ring_events) ? head - ring_events : 0;
+	for (uint64_t pos = tail; pos < head; pos++) {
+		trace_event_t *ev = &buf->events[pos % ring_events];
+		uint64_t ts = (ev->ts_ns > trace_start) ? ev->ts_ns - trace_start : 0;
+		fprintf(f, "%s{\"ph\":\"%c\",\"name\":", trace_empty ? "" : ",\n", ev->phase);
+		write_string(f, ev->name);
+		fprintf(f, ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", pid, ev->track ? ev->track : buf->tid, ts / 1000.0);
+		if (ev->phase == 'X')
+			fprintf(f, ",\"dur\":%.3f", ev->dur_ns / 1000.0);
+		if (ev->phase == 'i')
+			fprintf(f, ",\"s\":\"t\"");
+		if (ev->phase != 'E')
+			fprintf(f, ",\"args\":{\"arg\":%lu}", (unsigned long)ev->arg);
+		fprintf(f, "}");
+		trace_empty = false;
+	}
+}
+
+/**
+ * Write out the events of a thread that exits, and keep its ring for the
+ * next thread.
+ *
+ * @param arg: buffer of the thread
+ */
+static void flush_thread(void *arg)
+{
+	trace_buffer_t *buf = (trace_buffer_t *)arg;
+	thread_buffer = NULL;
+
+	pthread_mutex_lock(&trace_lock);
+	write_buffer(buf);
+	for (trace_buffer_t **prev = &trace_buffers; *prev != NULL; prev = &(*prev)->next) {
+		if (*prev == buf) {
+			*prev = buf->next;
+			break;
+		}
+	}
+	buf->next = free_buffers;
+	free_buffers = buf;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Write the events of the threads still running and close the trace. Runs
+ * at exit, threads still recording at that point may leave a few torn
+ * events.
+ */
+static void write_trace(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	for (trace_buffer_t *buf = trace_buffers; buf != NULL; buf = buf->next)
+		write_buffer(buf);
+	fprintf(trace_file, "\n]}\n");
+	fclose(trace_file);
+	trace_file = NULL;
+	pthread_mutex_unlock(&trace_lock);
+	printf("Trace written to %s\n", trace_path);
+}
+
+static void trace_setup(void)
+{
+	const char *path = getenv(PIM_TRACE_ENV);
+	if (path == NULL || path[0] == '\0')
+		return;
+
+	const char *events = getenv(PIM_TRACE_EVENTS_ENV);
+	if (events != NULL && events[0] != '\0') {
+		char *end;
+		unsigned long parsed = strtoul(events, &end, 0);
+		if (*end != '\0' || parsed == 0)
+			fprintf(stderr, "Ignoring invalid %s=%s\n", PIM_TRACE_EVENTS_ENV, events);
+		else
+			ring_events = parsed;
+	}
+
+	if (pthread_key_create(&trace_key, flush_thread) != 0)
+		return;
+	trace_file = fopen(path, "w");
+	if (trace_file == NULL) {
+		fprintf(stderr, "Failed to write the trace to %s\n", path);
+		return;
+	}
+	fprintf(trace_file, "{\"traceEvents\":[\n");
+	trace_start = trace_clock();
+	trace_path = path;
+	atexit(write_trace);
+}
+
+/**
+ * Get the ring of the calling thread, set up on its first event.
+ *
+ * @return the buffer, NULL if it could not be allocated
+ */
+static inline trace_buffer_t *get_thread_buffer(void)
+{
+	if (thread_buffer == NULL) {
+		thread_buffer = add_buffer(syscall(SYS_gettid), true);
+		if (thread_buffer == NULL)
+			return NULL;
+		memcpy(thread_buffer->name, thread_name, sizeof(thread_name));
+		pthread_setspecific(trace_key, thread_buffer);
+	}
+	return thread_buffer;
+}
+
+/**
+ * Record an event on the ring of the calling thread.
+ */
+static void record(char phase, const char *name, uint64_t ts_ns, uint64_t dur_ns, uint64_t arg, int32_t track)
+{
+	trace_buffer_t *buf = get_thread_buffer();
+	if (buf == NULL)
+		return;
+
+	trace_event_t *ev = &buf->events[buf->head % ring_events];
+	ev->ts_ns = ts_ns;
+	ev->dur_ns = dur_ns;
+	ev->name = name;
+	ev->arg = arg;
+	ev->track = track;
+	ev->phase = phase;
+	buf->head++;
+}
+
+bool pim_trace_enabled(void)
+{
+	pthread_once(&trace_once, trace_setup);
+	return trace_path != NULL;
+}
+
+uint64_t pim_trace_now(void)
+{
+	return pim_trace_enabled() ? trace_clock() : 0;
+}
+
+int32_t pim_trace_track(const char *name, unsigned idx)
+{
+	if (!pim_trace_enabled())
+		return 0;
+
+	int32_t track = atomic_fetch_add(&next_track, 1);
+	trace_buffer_t *buf = add_buffer(track, false);
+	if (buf != NULL)
+		snprintf(buf->name, sizeof(buf->name), "%s %u", name, idx);
+	return track;
+}
+
+void pim_trace_complete(const char *name, uint64_t start_ns, uint64_t arg, int32_t track)
+{
+	if (pim_trace_enabled() && start_ns != 0) {
+		uint64_t now = trace_clock();
+		record('X', name, start_ns, now - start_ns, arg, track);
+	}
+}
+
+void pim_trace_mark(const char *name, uint64_t arg, int32_t track)
+{
+	if (pim_trace_enabled())
+		record('i', name, trace_clock(), 0, arg, track);
+}
+
+void pim_trace_begin(const char *name, unsigned long arg)
+{
+	if (pim_trace_enabled())
+		record('B', name, trace_clock(), 0, arg, 0);
+}
+
+void pim_trace_end(const char *name)
+{
+	if (pim_trace_enabled())
+		record('E', name, trace_clock(), 0, 0, 0);
+}
+
+void pim_trace_instant(const char *name, unsigned long arg)
+{
+	pim_trace_mark(name, arg, 0);
+}
+
+void pim_trace_thread_name(const char *name, unsigned idx)
+{
+	if (!pim_trace_enabled())
+		return;
+
+	// The ring is only set up once the thread records an event
+	snprintf(thread_name, sizeof(thread_name), "%s %u", name, idx);
+	if (thread_buffer != NULL)
+		memcpy(thread_buffer->name, thread_name, sizeof(thread_name));
+}
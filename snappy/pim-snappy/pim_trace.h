@@ -0,0 +1,63 @@
+#ifndef _PIM_TRACE_H_
+#define _PIM_TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Default number of events kept for each running thread, older ones are
+// overwritten. A thread writes its events out when it exits
+#define PIM_TRACE_EVENTS 1024
+
+// Environment variable overriding PIM_TRACE_EVENTS
+#define PIM_TRACE_EVENTS_ENV "PIM_TRACE_EVENTS"
+
+// Environment variable naming the file the trace is written to at exit,
+// nothing is recorded when it is not set
+#define PIM_TRACE_ENV "PIM_TRACE"
+
+
+/**
+ * Check whether events are being recorded.
+ *
+ * @return True if PIM_TRACE named a file that could be created when the first
+ * event was recorded
+ */
+bool pim_trace_enabled(void);
+
+/**
+ * Get a timestamp for pim_trace_complete.
+ *
+ * @return time in ns, 0 if tracing is off
+ */
+uint64_t pim_trace_now(void);
+
+/**
+ * Create a track of the timeline for something that is not a thread, like a
+ * rank.
+ *
+ * @param name: name of the track, a number is appended to it
+ * @param idx: the number
+ * @return the track, 0 if tracing is off
+ */
+int32_t pim_trace_track(const char *name, unsigned idx);
+
+/**
+ * Record a span that started at start_ns and ends now.
+ *
+ * @param name: name of the span, must outlive the process
+ * @param start_ns: pim_trace_now at the start of the span
+ * @param arg: value shown with the span
+ * @param track: track to draw the span on, 0 for the calling thread
+ */
+void pim_trace_complete(const char *name, uint64_t start_ns, uint64_t arg, int32_t track);
+
+/**
+ * Record an instant event.
+ *
+ * @param name: name of the event, must outlive the process
+ * @param arg: value shown with the event
+ * @param track: track to draw the event on, 0 for the calling thread
+ */
+void pim_trace_mark(const char *name, uint64_t arg, int32_t track);
+
+#endif	/* _PIM_TRACE_H_ */
@@ -1400,18 +1400,46 @@ class SnappyArrayWriter {
   inline void Flush() {}
 };
 
+#if (USE_PIM == 1)
+// CPU decompressor the hybrid mode of the PIM library routes blocks to.
+// The header is read once and the output capped at the length the library
+// checked, since another process may rewrite the input while it is read.
+static int CpuUncompress(const char* compressed, size_t compressed_length,
+                         char* uncompressed, size_t uncompressed_length) {
+  ByteArraySource reader(compressed, compressed_length);
+  SnappyDecompressor decompressor(&reader);
+  uint32_t header_len = 0;
+  if (!decompressor.ReadUncompressedLength(&header_len) ||
+      header_len != uncompressed_length) {
+    return false;
+  }
+  SnappyArrayWriter writer(uncompressed);
+  return InternalUncompressAllTags(&decompressor, &writer, compressed_length,
+                                   header_len);
+}
+
+extern "C" void pim_use_snappy_cpu_decompressor(void) {
+  pim_set_cpu_decompressor(CpuUncompress);
+}
+#endif
+
 bool RawUncompress(const char* compressed, size_t compressed_length,
                    char* uncompressed) {
 #if (USE_PIM == 0)
   ByteArraySource reader(compressed, compressed_length);
   return RawUncompress(&reader, uncompressed);
 #else
+  static const bool cpu_registered =
+      (pim_use_snappy_cpu_decompressor(), true);
+  (void)cpu_registered;
+
   size_t ulength;
   if (!GetUncompressedLength(compressed, compressed_length, &ulength)) {
     return false;
   }
-  if(ulength == BLOCK_SIZE)
-    return (bool)pim_decompress(compressed, compressed_length, uncompressed);
+  pim_ctx_t *pim = pim_get_default();
+  if(ulength > 0 && ulength <= pim_get_block_size(pim))
+    return (bool)pim_decompress(pim, compressed, compressed_length, uncompressed);
   else {
     ByteArraySource reader(compressed, compressed_length);
     return RawUncompress(&reader, uncompressed);